@@ -0,0 +1,1556 @@
+/*
+shepherd_bench.cpp
+Benchmarks for the image processing application
+
+Times decoding, encoding, the pyramid and every process_N filter on
+sample.bmp and on synthetic 4K, 8K and 16K images, and reports megapixels
+per second, bytes per second, heap allocations and new image buffers per
+run, as a table or as JSON that can be diffed between commits.
+
+With --verify it instead checks every engine (each SIMD level, threaded, the
+fused pipeline, the menu session and streaming) against the original
+per-pixel filters, on sample.bmp against the images in sample_images and on
+random images of odd sizes with random recipes, and runs every filter table
+and SIMD kernel over all 2^24 colors against the per-pixel filters.
+
+    shepherd_bench [--sample FILE] [--sizes sample,4k,8k,16k] [--filter TEXT]
+                   [--min-time SECONDS] [--threads N] [--tmp DIR] [--json]
+    shepherd_bench --verify [--sample FILE] [--goldens DIR] [--fuzz N] [--seed S] [--tmp DIR]
+    shepherd_bench --help
+*/
+
+#define IMAGE_PROCESSOR_NO_MAIN
+#include "shepherd_main.cpp"
+
+#include <atomic>
+#include <ctime>
+#include <new>
+#include <random>
+#include <set>
+
+// Heap allocations made through operator new, for the allocation counts
+// (noinline keeps GCC from pairing the inlined malloc and free with new and delete)
+atomic<long> allocation_count(0);
+atomic<long> allocation_bytes(0);
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
+    void* block = malloc(size == 0 ? 1 : size);
+    if(block == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void* block) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void* block, size_t) noexcept
+{
+    operator delete(block);
+}
+
+// One timed operation on one image size
+struct BenchCase
+{
+    string name;                // "process_3/4k"
+    long pixels;                // Input pixels per run
+    long bytes;                 // Bytes read plus bytes written per run
+    function<void()> run;
+};
+
+// Averages over the timed runs of a case
+struct BenchResult
+{
+    string name;
+    long iterations;
+    double real_ms;             // Wall time per run
+    double cpu_ms;              // Process CPU time per run, all threads
+    double megapixels_per_second;
+    double bytes_per_second;
+    double allocations;         // operator new calls per run
+    double allocated_bytes;
+    double new_buffers;         // Image buffers the pool had to allocate per run
+};
+
+// Process CPU time in milliseconds
+double cpu_time_ms()
+{
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+/**
+ * Runs a case once to warm up, then repeatedly until min_seconds of wall
+ * time have passed, at least once
+ * @param bench       The case
+ * @param min_seconds Minimum time to spend timing
+ * @return the averages
+ */
+BenchResult run_case(const BenchCase& bench, double min_seconds)
+{
+    bench.run();
+
+    BenchResult result;
+    result.name = bench.name;
+    long count_before = allocation_count;
+    long bytes_before = allocation_bytes;
+    long buffers_before = buffer_pool_stats().allocated;
+    double cpu_before = cpu_time_ms();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long iterations = 0;
+    double wall_ms = 0;
+    while(iterations == 0 || wall_ms < min_seconds * 1000)
+    {
+        bench.run();
+        iterations++;
+        wall_ms = elapsed_ms(start);
+    }
+
+    result.iterations = iterations;
+    result.real_ms = wall_ms / iterations;
+    result.cpu_ms = (cpu_time_ms() - cpu_before) / iterations;
+    result.megapixels_per_second = bench.pixels / 1e3 / result.real_ms;
+    result.bytes_per_second = bench.bytes * 1e3 / result.real_ms;
+    result.allocations = (double)(allocation_count - count_before) / iterations;
+    result.allocated_bytes = (double)(allocation_bytes - bytes_before) / iterations;
+    result.new_buffers = (double)(buffer_pool_stats().allocated - buffers_before) / iterations;
+    return result;
+}
+
+/**
+ * Makes a reproducible image of random pixels
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @return the new image
+ */
+Image make_noise_image(int width, int height)
+{
+    Image image = make_image(width, height);
+    unsigned int state = 2463534242u;
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* row = image_row(image, r);
+        for(int i=0; i<width*3; i++)
+        {
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[i] = state >> 24;
+        }
+    }
+    return image;
+}
+
+/**
+ * Adds the decode, encode and filter cases for one image
+ * The image is written to the temporary directory so decoding reads a file
+ * @param label    Size label used in the case names
+ * @param image    The input image, kept alive by the cases
+ * @param tmp_dir  Directory for the image files
+ * @param cases    The list to add to
+ * @return True if the image file could be written
+ */
+bool add_size_cases(string label, shared_ptr<const Image> image, string tmp_dir, vector<BenchCase>& cases)
+{
+    string input_file = tmp_dir + "/shepherd_bench_" + label + ".bmp";
+    string output_file = tmp_dir + "/shepherd_bench_" + label + "_out.bmp";
+    if(!write_packed_image(input_file, *image))
+    {
+        return false;
+    }
+    long pixels = (long)image->width * image->height;
+    long file_size = file_bytes(input_file);
+
+    BenchCase decode;
+    decode.name = "decode/" + label;
+    decode.pixels = pixels;
+    decode.bytes = file_size;
+    decode.run = [=]() { read_packed_image(input_file); };
+    cases.push_back(decode);
+
+    BenchCase encode;
+    encode.name = "encode/" + label;
+    encode.pixels = pixels;
+    encode.bytes = file_size;
+    encode.run = [=]() { write_packed_image(output_file, *image); };
+    cases.push_back(encode);
+
+    // A five color result, which --palette writes as a 4 bit RLE file
+    shared_ptr<const Image> few_colors = make_shared<Image>(process_10(*image));
+    BenchCase paletted;
+    paletted.name = "encode paletted/" + label;
+    paletted.pixels = pixels;
+    paletted.bytes = file_size;
+    paletted.run = [=]() { vector<unsigned char> file; encode_paletted_image(*few_colors, file); };
+    cases.push_back(paletted);
+
+    // The 1/2, 1/4 and 1/8 levels read the image once and write a third of its bytes
+    BenchCase pyramid;
+    pyramid.name = "pyramid/" + label;
+    pyramid.pixels = pixels;
+    pyramid.bytes = file_size + file_size / 3;
+    pyramid.run = [=]() { write_pyramid(output_file, *image, PYRAMID_LEVELS); };
+    cases.push_back(pyramid);
+
+    // Same parameters as the scaling report; enlarge writes four times the bytes
+    function<Image(const Image&)> filters[] = {
+        [](const Image& source) { return process_1(source); },
+        [](const Image& source) { return process_2(source, 0.3); },
+        [](const Image& source) { return process_3(source); },
+        [](const Image& source) { return process_4(source); },
+        [](const Image& source) { return process_5(source, 2); },
+        [](const Image& source) { return process_6(source, 2, 2); },
+        [](const Image& source) { return process_7(source); },
+        [](const Image& source) { return process_8(source, 0.5); },
+        [](const Image& source) { return process_9(source, 0.5); },
+        [](const Image& source) { return process_10(source); }
+    };
+    long image_bytes = (long)image->stride * image->height;
+    for(int f=0; f<10; f++)
+    {
+        BenchCase filter;
+        filter.name = "process_" + to_string(f + 1) + "/" + label;
+        filter.pixels = pixels;
+        filter.bytes = image_bytes * (f == 5 ? 5 : 2);
+        function<Image(const Image&)> process = filters[f];
+        filter.run = [=]() { process(*image); };
+        cases.push_back(filter);
+    }
+    return true;
+}
+
+// Writes a string as a JSON string literal
+string json_string(string text)
+{
+    string quoted = "\"";
+    for(size_t i=0; i<text.size(); i++)
+    {
+        if(text[i] == '"' || text[i] == '\\')
+        {
+            quoted += '\\';
+        }
+        quoted += text[i];
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Prints the results as JSON: a context object describing the run and one
+ * object per case, in a stable order so files can be diffed across commits
+ * @param results The results
+ * @param min_seconds The minimum time per case
+ * @return nothing
+ */
+void print_json(const vector<BenchResult>& results, double min_seconds)
+{
+    cout << "{" << endl;
+    cout << "  \"context\": {" << endl;
+    cout << "    \"threads\": " << configured_threads() << "," << endl;
+    cout << "    \"simd\": " << json_string(simd_kernels().name) << "," << endl;
+    cout << "    \"min_time_seconds\": " << min_seconds << endl;
+    cout << "  }," << endl;
+    cout << "  \"benchmarks\": [" << endl;
+    for(size_t i=0; i<results.size(); i++)
+    {
+        const BenchResult& result = results[i];
+        cout << "    {\"name\": " << json_string(result.name)
+             << ", \"iterations\": " << result.iterations
+             << fixed << setprecision(3)
+             << ", \"real_time_ms\": " << result.real_ms
+             << ", \"cpu_time_ms\": " << result.cpu_ms
+             << ", \"megapixels_per_second\": " << result.megapixels_per_second
+             << setprecision(0)
+             << ", \"bytes_per_second\": " << result.bytes_per_second
+             << setprecision(1)
+             << ", \"allocations_per_iteration\": " << result.allocations
+             << setprecision(0)
+             << ", \"allocated_bytes_per_iteration\": " << result.allocated_bytes
+             << setprecision(1)
+             << ", \"new_buffers_per_iteration\": " << result.new_buffers
+             << "}" << (i+1 < results.size() ? "," : "") << endl;
+        cout.unsetf(ios::fixed);
+    }
+    cout << "  ]" << endl;
+    cout << "}" << endl;
+}
+
+// Prints one result as a table row
+void print_row(const BenchResult& result)
+{
+    cout << left << setw(22) << result.name << right << fixed
+         << setprecision(3) << setw(12) << result.real_ms
+         << setw(12) << result.cpu_ms
+         << setw(8) << result.iterations
+         << setprecision(1) << setw(10) << result.megapixels_per_second
+         << setw(12) << result.bytes_per_second / 1e6
+         << setw(10) << result.allocations
+         << setw(14) << result.allocated_bytes / 1e6
+         << setw(10) << result.new_buffers << endl;
+}
+
+// The original per-pixel filters, kept as the reference every faster path is
+// checked against by --verify
+
+//Adds vignette effect to image (dark corners)
+vector<vector<Pixel>> reference_process_1(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+
+            double distance = sqrt(pow((c - width/2),2) + pow((r - height/2),2));
+            double scaling_factor = (height - distance) / height;
+            int new_red = red * scaling_factor;
+            int new_green = green * scaling_factor;
+            int new_blue = blue * scaling_factor;
+
+            new_image[r][c].red = new_red;
+            new_image[r][c].green = new_green;
+            new_image[r][c].blue = new_blue;
+        }
+    }
+    return new_image;
+}
+
+//Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+vector<vector<Pixel>> reference_process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+            int average = (red + green + blue) / 3;
+
+            if(average >= 170)
+            {
+                new_image[r][c].red = 255 - (255 - red) * scaling_factor;
+                new_image[r][c].green = 255 - (255 - green) * scaling_factor;
+                new_image[r][c].blue = 255 - (255 - blue) * scaling_factor;
+            }
+            else if(average < 90)
+            {
+                new_image[r][c].red = red * scaling_factor;
+                new_image[r][c].green = green * scaling_factor;
+                new_image[r][c].blue = blue * scaling_factor;
+            }
+            else
+            {
+                new_image[r][c].red = red;
+                new_image[r][c].green = green;
+                new_image[r][c].blue = blue;
+            }
+        }
+    }
+    return new_image;
+}
+
+// Grayscale image
+vector<vector<Pixel>> reference_process_3(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+            int gray_value = (red + green + blue) / 3;
+
+             new_image[r][c].red = gray_value;
+             new_image[r][c].green = gray_value;
+             new_image[r][c].blue = gray_value;
+        }
+    }
+    return new_image;
+}
+
+// Rotates image by 90 degrees clockwise (not counter-clockwise)
+vector<vector<Pixel>> reference_process_4(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(width, vector<Pixel> (height));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+
+            new_image[c][(height-1)-r].red = red;
+            new_image[c][(height-1)-r].green = green;
+            new_image[c][(height-1)-r].blue = blue;
+        }
+    }
+    return new_image;
+}
+
+// Rotates image by a specified number of multiples of 90 degrees clockwise
+vector<vector<Pixel>> reference_process_5(const vector<vector<Pixel>>& image, int number)
+{
+    int angle = number * 90;
+
+    if(angle%90 != 0)
+    {
+        cout << "angle must be a multiple of 90 degrees.";
+        return image;
+    }
+    else if(angle%360 == 0)
+    {
+        return image;
+    }
+    else if(angle%360 == 90)
+    {
+        return reference_process_4(image);
+    }
+    else if(angle%360 == 180)
+    {
+        return reference_process_4(reference_process_4(image));
+    }
+    else
+    {
+        return reference_process_4(reference_process_4(reference_process_4(image)));
+    }
+}
+
+// Enlarges the image in the x and y direction
+vector<vector<Pixel>> reference_process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height*y_scale, vector<Pixel> (width*x_scale));
+
+    for(int r=0; r<height*y_scale; r++)
+    {
+        for(int c=0; c<width*x_scale; c++)
+        {
+            int red = image[r/y_scale][c/x_scale].red;
+            int green = image[r/y_scale][c/x_scale].green;
+            int blue = image[r/y_scale][c/x_scale].blue;
+
+            new_image[r][c].red = red;
+            new_image[r][c].green = green;
+            new_image[r][c].blue = blue;
+        }
+    }
+    return new_image;
+}
+
+// Convert image to high contrast (black and white only)
+vector<vector<Pixel>> reference_process_7(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+            double gray_value = (red + green + blue) / 3;
+
+            if(gray_value >= 255/2)
+            {
+                new_image[r][c].red = 255;
+                new_image[r][c].green = 255;
+                new_image[r][c].blue = 255;
+            }
+            else
+            {
+                new_image[r][c].red = 0;
+                new_image[r][c].green = 0;
+                new_image[r][c].blue = 0;
+            }
+        }
+    }
+    return new_image;
+}
+
+// Lightens image by a scaling factor
+vector<vector<Pixel>> reference_process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+
+            new_image[r][c].red = 255 - (255 - red)*scaling_factor;
+            new_image[r][c].green = 255 - (255 - green)*scaling_factor;
+            new_image[r][c].blue = 255 - (255 - blue)*scaling_factor;
+        }
+    }
+    return new_image;
+}
+
+// Darkens image by a scaling factor
+vector<vector<Pixel>> reference_process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+
+            new_image[r][c].red = red * scaling_factor;
+            new_image[r][c].green = green * scaling_factor;
+            new_image[r][c].blue = blue * scaling_factor;
+        }
+    }
+    return new_image;
+}
+
+// Converts image to only black, white, red, blue, and green
+vector<vector<Pixel>> reference_process_10(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
+
+    for(int r=0; r<height; r++)
+    {
+        for(int c=0; c<width; c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+            int max_color;
+
+            if(red >= green && red >= blue)
+            {
+                max_color = red;
+            }
+            else if(green >= blue)
+            {
+                max_color = green;
+            }
+            else
+            {
+                max_color = blue;
+            }
+
+            if(red + green + blue >= 550)
+            {
+                new_image[r][c].red = 255;
+                new_image[r][c].green = 255;
+                new_image[r][c].blue = 255;
+            }
+            else if(red + green + blue <= 150)
+            {
+                new_image[r][c].red = 0;
+                new_image[r][c].green = 0;
+                new_image[r][c].blue = 0;
+            }
+            else if(max_color == red)
+            {
+                new_image[r][c].red = 255;
+                new_image[r][c].green = 0;
+                new_image[r][c].blue = 0;
+            }
+            else if(max_color == green)
+            {
+                new_image[r][c].red = 0;
+                new_image[r][c].green = 255;
+                new_image[r][c].blue = 0;
+            }
+            else
+            {
+                new_image[r][c].red = 0;
+                new_image[r][c].green = 0;
+                new_image[r][c].blue = 255;
+            }
+        }
+    }
+    return new_image;
+}
+
+// Halves an image: each pixel is the rounded average of a 2x2 block, with
+// the last row or column used twice when the size is odd
+vector<vector<Pixel>> reference_downsample(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<vector<Pixel>> new_image((height + 1) / 2, vector<Pixel> ((width + 1) / 2));
+
+    for(int r=0; r<(height + 1) / 2; r++)
+    {
+        for(int c=0; c<(width + 1) / 2; c++)
+        {
+            int rows[] = { 2 * r, min(2 * r + 1, height - 1) };
+            int columns[] = { 2 * c, min(2 * c + 1, width - 1) };
+            int red = 2;
+            int green = 2;
+            int blue = 2;
+            for(int i=0; i<2; i++)
+            {
+                for(int j=0; j<2; j++)
+                {
+                    red += image[rows[i]][columns[j]].red;
+                    green += image[rows[i]][columns[j]].green;
+                    blue += image[rows[i]][columns[j]].blue;
+                }
+            }
+            new_image[r][c].red = red / 4;
+            new_image[r][c].green = green / 4;
+            new_image[r][c].blue = blue / 4;
+        }
+    }
+    return new_image;
+}
+
+// Applies one recipe stage with the reference filters
+vector<vector<Pixel>> reference_stage(const vector<vector<Pixel>>& image, const FilterStage& stage)
+{
+    switch(stage.process)
+    {
+        case 1: return reference_process_1(image);
+        case 2: return reference_process_2(image, stage.scaling_factor);
+        case 3: return reference_process_3(image);
+        case 4: return reference_process_4(image);
+        case 5: return reference_process_5(image, stage.number);
+        case 6: return reference_process_6(image, stage.x_scale, stage.y_scale);
+        case 7: return reference_process_7(image);
+        case 8: return reference_process_8(image, stage.scaling_factor);
+        case 9: return reference_process_9(image, stage.scaling_factor);
+        default: return reference_process_10(image);
+    }
+}
+
+// Applies one recipe stage through the vector of Pixels interface
+vector<vector<Pixel>> process_stage(const vector<vector<Pixel>>& image, const FilterStage& stage)
+{
+    switch(stage.process)
+    {
+        case 1: return process_1(image);
+        case 2: return process_2(image, stage.scaling_factor);
+        case 3: return process_3(image);
+        case 4: return process_4(image);
+        case 5: return process_5(image, stage.number);
+        case 6: return process_6(image, stage.x_scale, stage.y_scale);
+        case 7: return process_7(image);
+        case 8: return process_8(image, stage.scaling_factor);
+        case 9: return process_9(image, stage.scaling_factor);
+        default: return process_10(image);
+    }
+}
+
+// Counts of the comparisons made by --verify
+struct VerifyRun
+{
+    string tmp_dir;
+    long checks;
+    long failures;
+};
+
+// Whole contents of a file, empty if it cannot be read
+string file_contents(string filename)
+{
+    ifstream stream(filename, ios::binary);
+    stringstream contents;
+    contents << stream.rdbuf();
+    return contents.str();
+}
+
+// The BMP file write_packed_image makes for an image
+string encode_image(VerifyRun& run, const Image& image)
+{
+    string filename = run.tmp_dir + "/shepherd_verify_encoded.bmp";
+    if(!write_packed_image(filename, image))
+    {
+        return "";
+    }
+    return file_contents(filename);
+}
+
+// Counts one comparison and reports it if it failed
+void expect(VerifyRun& run, bool same, string label, string variant)
+{
+    run.checks++;
+    if(!same)
+    {
+        run.failures++;
+        cout << "FAIL " << label << ": " << variant << endl;
+    }
+}
+
+/**
+ * Runs a recipe through every engine and compares each result with the
+ * expected BMP file byte for byte: the packed filters and the fused
+ * pipeline, out of place and in place, at every SIMD level at 1 and 3
+ * threads, the menu's session path (including the mapped input filters)
+ * and streaming with one row and one megabyte bands
+ * @param run        Counts and the temporary directory
+ * @param label      Name of the image and recipe for failure reports
+ * @param image      The source image
+ * @param input_file The source image as a BMP file
+ * @param stages     The recipe
+ * @param expected   The expected BMP file contents
+ * @return nothing
+ */
+void check_engines(VerifyRun& run, string label, const Image& image, string input_file,
+                   const vector<FilterStage>& stages, const string& expected)
+{
+    string initial_level = simd_kernels().name;
+    int initial_threads = configured_threads();
+    string stream_file = run.tmp_dir + "/shepherd_verify_stream.bmp";
+    const char* levels[] = { "scalar", "sse4.1", "avx2" };
+    string tried;
+    for(int l=0; l<3; l++)
+    {
+        string level = set_simd_level(levels[l]);
+        if(tried.find("[" + level + "]") != string::npos)
+        {
+            continue;
+        }
+        tried += "[" + level + "]";
+
+        for(int threads=1; threads<=3; threads+=2)
+        {
+            set_thread_count(threads);
+            string variant = level + ", " + to_string(threads) + " threads";
+            expect(run, encode_image(run, run_pipeline(image, stages)) == expected, label, variant + ", pipeline");
+            Image copy = image;
+            expect(run, encode_image(run, run_pipeline(move(copy), stages)) == expected, label, variant + ", pipeline in place");
+            if(stages.size() == 1)
+            {
+                Image result = to_image(process_stage(to_pixels(image), stages[0]));
+                expect(run, encode_image(run, result) == expected, label, variant + ", process_" + to_string(stages[0].process));
+            }
+        }
+
+        SessionCache session;
+        clear_session(session);
+        shared_ptr<const Image> result = session_result(session, input_file, stages);
+        expect(run, result && encode_image(run, *result) == expected, label, level + ", session");
+
+        long budgets[] = { 1, 1L << 20 };
+        for(int b=0; b<2; b++)
+        {
+            vector<int> band_rows;
+            bool streamed = stream_stages(input_file, stream_file, stages, budgets[b], band_rows);
+            expect(run, streamed && file_contents(stream_file) == expected, label,
+                   level + ", stream, " + (b == 0 ? "1 row" : "1 MB") + " bands");
+        }
+    }
+    unlink(stream_file.c_str());
+    set_simd_level(initial_level);
+    set_thread_count(initial_threads);
+}
+
+/**
+ * Checks that every way of writing and reading a BMP file agrees with the
+ * original read_image and write_image, padding bytes included
+ * @param run        Counts and the temporary directory
+ * @param label      Name of the image for failure reports
+ * @param image      The image
+ * @param input_file Set to a BMP file of the image for later checks
+ * @return the BMP file contents
+ */
+string check_files(VerifyRun& run, string label, const Image& image, string& input_file)
+{
+    input_file = run.tmp_dir + "/shepherd_verify_input.bmp";
+    string other_file = run.tmp_dir + "/shepherd_verify_other.bmp";
+    string expected = encode_image(run, image);
+    write_packed_image(input_file, image);
+
+    vector<vector<Pixel>> pixels = to_pixels(image);
+    expect(run, write_image(other_file, pixels) && file_contents(other_file) == expected, label, "write_image");
+    expect(run, write_image_buffered(other_file, pixels) && file_contents(other_file) == expected, label, "write_image_buffered");
+    expect(run, write_packed_image_mmap(other_file, image) && file_contents(other_file) == expected, label, "write_packed_image_mmap");
+    expect(run, encode_image(run, to_image(read_image(input_file))) == expected, label, "read_image");
+    expect(run, encode_image(run, read_packed_image(input_file)) == expected, label, "read_packed_image");
+    unlink(other_file.c_str());
+    return expected;
+}
+
+/**
+ * Checks that an image written as a paletted BMP reads back as the same
+ * pixels through both decoders, or is refused if it has too many colors
+ * @param run      Counts and the temporary directory
+ * @param label    Name of the image for failure reports
+ * @param image    The image
+ * @param expected The image as a 24 bit BMP file
+ * @return nothing
+ */
+void check_paletted(VerifyRun& run, string label, const Image& image, const string& expected)
+{
+    set<unsigned int> colors;
+    for(int r=0; r<image.height; r++)
+    {
+        const unsigned char* pixel = image_row(image, r);
+        for(int c=0; c<image.width; c++, pixel+=3)
+        {
+            colors.insert(pixel[0] | (pixel[1] << 8) | (pixel[2] << 16));
+        }
+    }
+    vector<unsigned char> file;
+    bool encoded = encode_paletted_image(image, file);
+    expect(run, encoded == ((int)colors.size() <= PALETTE_COLORS), label, "paletted, " + to_string(colors.size()) + " colors");
+    if(!encoded)
+    {
+        return;
+    }
+
+    string paletted_file = run.tmp_dir + "/shepherd_verify_paletted.bmp";
+    Image decoded;
+    string variant = "paletted, " + to_string(file[28]) + " bit, compression " + to_string(file[30]);
+    expect(run, write_encoded_file(paletted_file, file)
+                && encode_image(run, read_packed_image(paletted_file)) == expected, label, variant + ", read_packed_image");
+    expect(run, decode_packed_image(file.data(), file.size(), decoded)
+                && encode_image(run, decoded) == expected, label, variant + ", decode_packed_image");
+    unlink(paletted_file.c_str());
+}
+
+// An image of runs of random lengths drawn from a palette of random colors
+Image random_paletted_image(mt19937& random, int width, int height, int colors)
+{
+    vector<unsigned int> palette(colors);
+    for(int i=0; i<colors; i++)
+    {
+        palette[i] = uniform_int_distribution<unsigned int>(0, 0xffffff)(random);
+    }
+    int longest = uniform_int_distribution<int>(1, 300)(random);
+    Image image = make_image(width, height);
+    unsigned int color = palette[0];
+    int left = 0;
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* pixel = image_row(image, r);
+        for(int c=0; c<width; c++, pixel+=3)
+        {
+            if(left-- <= 0)
+            {
+                color = palette[uniform_int_distribution<int>(0, colors - 1)(random)];
+                left = uniform_int_distribution<int>(0, longest)(random);
+            }
+            pixel[0] = color;
+            pixel[1] = color >> 8;
+            pixel[2] = color >> 16;
+        }
+    }
+    return image;
+}
+
+/**
+ * Checks the pyramid levels written for an image in memory and while
+ * streaming it in one row bands against reference_downsample(), at every
+ * SIMD level
+ * @param run        Counts and the temporary directory
+ * @param label      Name of the image for failure reports
+ * @param image      The image
+ * @param input_file The image as a BMP file
+ * @return nothing
+ */
+void check_pyramid(VerifyRun& run, string label, const Image& image, string input_file)
+{
+    vector<string> expected;
+    vector<vector<Pixel>> level = to_pixels(image);
+    for(int l=0; l<PYRAMID_LEVELS; l++)
+    {
+        level = reference_downsample(level);
+        expected.push_back(encode_image(run, to_image(level)));
+    }
+
+    string initial_level = simd_kernels().name;
+    int initial_levels = pyramid_levels();
+    string pyramid_file = run.tmp_dir + "/shepherd_verify_pyramid.bmp";
+    const char* levels[] = { "scalar", "sse4.1", "avx2" };
+    string tried;
+    for(int l=0; l<3; l++)
+    {
+        string simd = set_simd_level(levels[l]);
+        if(tried.find("[" + simd + "]") != string::npos)
+        {
+            continue;
+        }
+        tried += "[" + simd + "]";
+
+        for(int streamed=0; streamed<2; streamed++)
+        {
+            bool written;
+            if(streamed == 0)
+            {
+                written = write_pyramid(pyramid_file, image, PYRAMID_LEVELS);
+            }
+            else
+            {
+                vector<int> band_rows;
+                pyramid_levels() = PYRAMID_LEVELS;
+                written = stream_stages(input_file, pyramid_file, vector<FilterStage>(), 1, band_rows);
+                pyramid_levels() = initial_levels;
+            }
+            for(int p=0; p<PYRAMID_LEVELS; p++)
+            {
+                string level_file = pyramid_level_name(pyramid_file, p + 1);
+                expect(run, written && file_contents(level_file) == expected[p], label,
+                       simd + ", pyramid 1/" + to_string(2 << p) + (streamed == 0 ? "" : ", stream"));
+                unlink(level_file.c_str());
+            }
+        }
+    }
+    unlink(pyramid_file.c_str());
+    set_simd_level(initial_level);
+}
+
+/**
+ * Runs many small batches back to back on four threads, so that threads
+ * still finishing one batch meet the tasks of the next, and checks that
+ * every task runs exactly once; a lost count hangs here instead. Then
+ * checks that a task's exception reaches the caller, on whichever thread
+ * it was thrown, and that batches from two callers at once both complete.
+ * @param run Counts
+ * @return nothing
+ */
+void check_scheduler(VerifyRun& run)
+{
+    int initial_threads = configured_threads();
+    set_thread_count(4);
+    const int BATCHES = 20000;
+    vector<atomic<int>> ran(64);
+    bool exact = true;
+    for(int b=0; b<BATCHES && exact; b++)
+    {
+        int count = 2 + b % 63;
+        for(int i=0; i<count; i++)
+        {
+            ran[i] = 0;
+        }
+        scheduler().run(count, [&](int i) { ran[i]++; });
+        for(int i=0; i<count; i++)
+        {
+            exact = exact && ran[i] == 1;
+        }
+    }
+    expect(run, exact, "scheduler", to_string(BATCHES) + " batches on 4 threads");
+
+    int caught = 0;
+    for(int b=0; b<1000; b++)
+    {
+        try
+        {
+            scheduler().run(64, [&](int i)
+            {
+                if(i % 16 == b % 16)
+                {
+                    throw runtime_error("task " + to_string(i));
+                }
+            });
+        }
+        catch(const runtime_error&)
+        {
+            caught++;
+        }
+    }
+    expect(run, caught == 1000, "scheduler", "exceptions from tasks reach the caller");
+
+    atomic<int> wrong(0);
+    vector<thread> callers;
+    for(int t=0; t<2; t++)
+    {
+        callers.push_back(thread([&]()
+        {
+            atomic<int> counts[40];
+            for(int b=0; b<BATCHES / 4; b++)
+            {
+                int count = 2 + b % 39;
+                for(int i=0; i<count; i++)
+                {
+                    counts[i] = 0;
+                }
+                scheduler().run(count, [&](int i) { counts[i]++; });
+                for(int i=0; i<count; i++)
+                {
+                    wrong += counts[i] != 1;
+                }
+            }
+        }));
+    }
+    for(size_t t=0; t<callers.size(); t++)
+    {
+        callers[t].join();
+    }
+    expect(run, wrong == 0, "scheduler", "batches from two callers at once");
+    set_thread_count(initial_threads);
+}
+
+/**
+ * Feeds parse_bmp_header headers with out of range fields, which must be
+ * refused rather than negated, multiplied or offset past what an int holds
+ * @param run    Counts
+ * @param header The first 54 bytes of a valid BMP file
+ * @return nothing
+ */
+void check_headers(VerifyRun& run, const string& header)
+{
+    BmpHeader parsed;
+    expect(run, header.size() >= 54 && parse_bmp_header((const unsigned char*)header.data(), parsed),
+           "headers", "valid header");
+    // Field offset and the value written there
+    const int fields[][2] = {
+        { 22, INT_MIN },        // Height with no positive counterpart
+        { 18, INT_MAX },        // Width whose rows overflow an int
+        { 18, 1 << 29 },        // Width within an int, but over 4 GB at any height
+        { 22, INT_MAX },        // Height over 4 GB at any width
+        { 14, INT_MAX },        // DIB header size past the end of any file
+        { 14, 12 },             // DIB header too small for the fields read
+        { 10, INT_MIN },        // Pixel data before the headers
+    };
+    for(const int* field : fields)
+    {
+        string changed = header.substr(0, 54);
+        for(int i=0; i<4; i++)
+        {
+            changed[field[0] + i] = (char)((unsigned int)field[1] >> (i * 8));
+        }
+        expect(run, !parse_bmp_header((const unsigned char*)changed.data(), parsed), "headers",
+               "offset " + to_string(field[0]) + " = " + to_string(field[1]));
+    }
+}
+
+// True if two images hold the same pixels, whatever their row padding
+bool same_pixels(const Image& a, const Image& b)
+{
+    if(a.width != b.width || a.height != b.height)
+    {
+        return false;
+    }
+    for(int r=0; r<a.height; r++)
+    {
+        if(memcmp(image_row(a, r), image_row(b, r), a.width * 3) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs every point filter table and every kernel over all 2^24 colors at
+ * each SIMD level the CPU has, scalar included, and compares the result
+ * with the reference filters byte for byte. The point filters go through
+ * apply_point_lut, so the scale kernels meet the tables they stand in for;
+ * replicate is checked against enlargement by 1 row and downsample against
+ * the reference halving. The colors lie in rows of an odd width, so every
+ * row also ends in a scalar tail, and are made a band of rows at a time
+ * @param run Counts
+ * @return nothing
+ */
+void check_kernels(VerifyRun& run)
+{
+    const int WIDTH = 4093;
+    const int BAND_ROWS = 256;      // Even, so downsampling pairs rows within a band
+    const int COLORS = 1 << 24;
+    int height = (COLORS + WIDTH - 1) / WIDTH;
+
+    vector<FilterStage> stages;
+    stages.push_back(make_stage(3));
+    stages.push_back(make_stage(7));
+    stages.push_back(make_stage(10));
+    double factors[] = { 0.0, 0.3, 0.5, 0.7, 1.0, 1.4, 2.5 };
+    for(double factor : factors)
+    {
+        stages.push_back(make_stage(2, factor));
+        stages.push_back(make_stage(8, factor));
+        stages.push_back(make_stage(9, factor));
+    }
+    vector<PointLut> luts;
+    for(size_t s=0; s<stages.size(); s++)
+    {
+        luts.push_back(stage_lut(stages[s]));
+    }
+
+    string initial_level = simd_kernels().name;
+    vector<string> levels;
+    vector<SimdKernels> kernels;
+    const char* names[] = { "scalar", "sse4.1", "avx2" };
+    for(const char* name : names)
+    {
+        if(select_simd_kernels(name).name == string(name))
+        {
+            levels.push_back(name);
+            kernels.push_back(select_simd_kernels(name));
+        }
+    }
+
+    // [stage or kernel][level], cleared by the first difference
+    const int X_SCALES = 3;
+    vector<vector<bool>> same(stages.size() + X_SCALES + 1, vector<bool>(levels.size(), true));
+    vector<unsigned char> row(WIDTH * 3 * (X_SCALES + 1));
+    for(int first=0; first<height; first+=BAND_ROWS)
+    {
+        Image band = make_image(WIDTH, min(BAND_ROWS, height - first));
+        for(int r=0; r<band.height; r++)
+        {
+            unsigned char* pixel = image_row(band, r);
+            for(int c=0; c<WIDTH; c++)
+            {
+                int color = ((first + r) * WIDTH + c) % COLORS;
+                pixel[c*3] = color & 0xff;
+                pixel[c*3+1] = (color >> 8) & 0xff;
+                pixel[c*3+2] = color >> 16;
+            }
+        }
+        vector<vector<Pixel>> pixels = to_pixels(band);
+
+        Image result = make_image(WIDTH, band.height);
+        for(size_t s=0; s<stages.size(); s++)
+        {
+            Image expected = to_image(reference_stage(pixels, stages[s]));
+            for(size_t l=0; l<levels.size(); l++)
+            {
+                set_simd_level(levels[l]);
+                apply_point_lut(luts[s], band, result);
+                same[s][l] = same[s][l] && same_pixels(expected, result);
+            }
+        }
+
+        for(int x=0; x<X_SCALES; x++)
+        {
+            int x_scale = x + 2;
+            Image expected = to_image(reference_process_6(pixels, x_scale, 1));
+            for(size_t l=0; l<levels.size(); l++)
+            {
+                for(int r=0; r<band.height; r++)
+                {
+                    kernels[l].replicate(image_row(band, r), row.data(), WIDTH, x_scale);
+                    same[stages.size() + x][l] = same[stages.size() + x][l]
+                        && memcmp(row.data(), image_row(expected, r), WIDTH * 3 * x_scale) == 0;
+                }
+            }
+        }
+
+        // The kernel takes whole 2x2 blocks, so the odd last column is left out
+        Image expected = to_image(reference_downsample(pixels));
+        for(size_t l=0; l<levels.size(); l++)
+        {
+            for(int r=0; r+1<band.height; r+=2)
+            {
+                kernels[l].downsample(image_row(band, r), image_row(band, r + 1), row.data(), WIDTH / 2);
+                same.back()[l] = same.back()[l] && memcmp(row.data(), image_row(expected, r / 2), WIDTH / 2 * 3) == 0;
+            }
+        }
+    }
+
+    for(size_t l=0; l<levels.size(); l++)
+    {
+        for(size_t s=0; s<stages.size(); s++)
+        {
+            expect(run, same[s][l], "all colors " + format_recipe(vector<FilterStage>(1, stages[s])), levels[l]);
+        }
+        for(int x=0; x<X_SCALES; x++)
+        {
+            expect(run, same[stages.size() + x][l], "all colors replicate x" + to_string(x + 2), levels[l]);
+        }
+        expect(run, same.back()[l], "all colors downsample", levels[l]);
+    }
+    set_simd_level(initial_level);
+}
+
+// The recipes the reference images in sample_images were made with
+vector<FilterStage> golden_stage(int process)
+{
+    switch(process)
+    {
+        case 2: return vector<FilterStage>(1, make_stage(2, 0.3));
+        case 5: return vector<FilterStage>(1, make_stage(5, 1.0, 2));
+        case 6: return vector<FilterStage>(1, make_stage(6, 1.0, 0, 2, 3));
+        case 8: return vector<FilterStage>(1, make_stage(8, 0.5));
+        case 9: return vector<FilterStage>(1, make_stage(9, 0.5));
+        default: return vector<FilterStage>(1, make_stage(process));
+    }
+}
+
+// A reference image in sample_images made with other parameters than the
+// assignment gives, which the filters follow. The parameters are recovered
+// from the images: in process7.bmp every pixel whose channel sum is 383 or
+// more is white and every other one black, and in process10.bmp the white
+// and black sums are the assignment's, but a pixel whose largest channel is
+// tied between green and blue still turns red.
+struct GoldenVariant
+{
+    int process;
+    int white_sum;          // Channel sums from here up turn white
+    int black_sum;          // Channel sums up to here turn black (process 10)
+    bool red_ties;          // Green or blue wins only when strictly largest
+    const char* parameters;
+};
+
+const GoldenVariant GOLDEN_VARIANTS[] = {
+    { 7, 383, -1, false, "white from an average of 127.5 (sum 383), not 127 (sum 381)" },
+    { 10, 550, 150, true, "ties for the largest channel go to red" },
+};
+
+// The variant a reference image was made with, or null for the filter's own
+const GoldenVariant* golden_variant(int process)
+{
+    for(const GoldenVariant& variant : GOLDEN_VARIANTS)
+    {
+        if(variant.process == process)
+        {
+            return &variant;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Remakes a reference image with the parameters it was made with
+ * @param image   The sample image
+ * @param variant How process 7 or 10 was run
+ * @return the image the reference should equal
+ */
+vector<vector<Pixel>> golden_variant_image(const vector<vector<Pixel>>& image, const GoldenVariant& variant)
+{
+    vector<vector<Pixel>> new_image = image;
+    for(size_t r=0; r<image.size(); r++)
+    {
+        for(size_t c=0; c<image[r].size(); c++)
+        {
+            int red = image[r][c].red;
+            int green = image[r][c].green;
+            int blue = image[r][c].blue;
+            int sum = red + green + blue;
+            bool green_wins = variant.red_ties ? green > red && green > blue : green > red && green >= blue;
+            bool blue_wins = variant.red_ties ? blue > red && blue > green : blue > red && blue > green;
+            int value = sum >= variant.white_sum ? 255 : 0;
+            Pixel& pixel = new_image[r][c];
+            pixel.red = pixel.green = pixel.blue = value;
+            if(variant.process == 10 && sum < variant.white_sum && sum > variant.black_sum)
+            {
+                pixel.red = !green_wins && !blue_wins ? 255 : 0;
+                pixel.green = green_wins ? 255 : 0;
+                pixel.blue = blue_wins ? 255 : 0;
+            }
+        }
+    }
+    return new_image;
+}
+
+// A random stage with parameters that include the edge cases: factors of 0,
+// 1 and above 1 (which wrap), rotations past a full turn, enlargement by 1
+FilterStage random_stage(mt19937& random)
+{
+    int process = uniform_int_distribution<int>(1, 10)(random);
+    double factors[] = { 0.0, 0.3, 0.5, 1.0, 1.4, 2.5 };
+    double factor = uniform_int_distribution<int>(0, 6)(random) < 6
+                  ? factors[uniform_int_distribution<int>(0, 5)(random)]
+                  : uniform_real_distribution<double>(0.0, 2.0)(random);
+    int number = uniform_int_distribution<int>(0, 7)(random);
+    int x_scale = uniform_int_distribution<int>(1, 4)(random);
+    int y_scale = uniform_int_distribution<int>(1, 4)(random);
+    return make_stage(process, factor, number, x_scale, y_scale);
+}
+
+/**
+ * Checks every engine against the reference filters: first on the sample
+ * image against the reference images in sample_images, then on random
+ * images of odd sizes, which exercise the row padding, with random recipes
+ * @param sample_file The sample image
+ * @param golden_dir  Directory holding process1.bmp to process10.bmp
+ * @param fuzz_images Number of random images
+ * @param seed        Seed for the random images and recipes
+ * @param tmp_dir     Directory for scratch files
+ * @return True if every check passed
+ */
+bool run_verify(string sample_file, string golden_dir, int fuzz_images, unsigned int seed, string tmp_dir)
+{
+    VerifyRun run = { tmp_dir, 0, 0 };
+    Image sample = read_packed_image(sample_file);
+    if(sample.width == 0)
+    {
+        cout << "Could not read " << sample_file << endl;
+        return false;
+    }
+    check_scheduler(run);
+    check_kernels(run);
+    check_headers(run, file_contents(sample_file));
+    string input_file;
+    check_files(run, "sample", sample, input_file);
+    check_pyramid(run, "sample", sample, input_file);
+    for(int p=1; p<=10; p++)
+    {
+        string golden_file = golden_dir + "/process" + to_string(p) + ".bmp";
+        string golden = file_contents(golden_file);
+        vector<FilterStage> stages = golden_stage(p);
+        Image reference_image = to_image(reference_stage(to_pixels(sample), stages[0]));
+        string reference = encode_image(run, reference_image);
+        check_paletted(run, "sample process_" + to_string(p), reference_image, reference);
+        long before = run.failures;
+        const GoldenVariant* variant = golden_variant(p);
+        if(golden.empty())
+        {
+            expect(run, false, golden_file, "missing");
+        }
+        else if(variant != nullptr)
+        {
+            // Made with other parameters; the engines still follow the filter
+            string remade = encode_image(run, to_image(golden_variant_image(to_pixels(sample), *variant)));
+            expect(run, golden == remade, golden_file, string("made with ") + variant->parameters);
+        }
+        else
+        {
+            expect(run, golden == reference, golden_file, "the reference filter");
+        }
+        check_engines(run, "sample " + format_recipe(stages), sample, input_file, stages, reference);
+        if(run.failures == before)
+        {
+            cout << golden_file << ": ok"
+                 << (variant != nullptr ? string(", made with ") + variant->parameters : "") << endl;
+        }
+    }
+
+    mt19937 random(seed);
+    for(int i=0; i<fuzz_images; i++)
+    {
+        int width = uniform_int_distribution<int>(1, 67)(random);
+        int height = uniform_int_distribution<int>(1, 37)(random);
+        Image image = make_image(width, height);
+        for(int r=0; r<height; r++)
+        {
+            unsigned char* row = image_row(image, r);
+            for(int b=0; b<width*3; b++)
+            {
+                row[b] = uniform_int_distribution<int>(0, 255)(random);
+            }
+        }
+        string label = to_string(width) + "x" + to_string(height) + " image " + to_string(i);
+        check_files(run, label, image, input_file);
+        check_pyramid(run, label, image, input_file);
+
+        vector<FilterStage> stages;
+        int count = uniform_int_distribution<int>(1, 3)(random);
+        vector<vector<Pixel>> reference = to_pixels(image);
+        for(int s=0; s<count; s++)
+        {
+            stages.push_back(random_stage(random));
+            // Values out of range wrap when stored, as in every other engine
+            reference = to_pixels(to_image(reference_stage(reference, stages.back())));
+        }
+        check_engines(run, label + " " + format_recipe(stages), image, input_file, stages,
+                      encode_image(run, to_image(reference)));
+
+        // 1 to 300 colors covers every bit depth and the refusal past 256
+        Image paletted = random_paletted_image(random, uniform_int_distribution<int>(1, 300)(random), height,
+                                               uniform_int_distribution<int>(1, 300)(random));
+        check_paletted(run, label + " paletted", paletted, encode_image(run, paletted));
+    }
+    unlink(input_file.c_str());
+    unlink((tmp_dir + "/shepherd_verify_encoded.bmp").c_str());
+
+    cout << "Random images: " << fuzz_images << " (seed " << seed << ")" << endl;
+    cout << "Checks: " << run.checks << ", failures: " << run.failures << endl;
+    return run.failures == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    string sample_file = "sample.bmp";
+    string sizes = "sample,4k,8k,16k";
+    string filter;
+    string tmp_dir = "/tmp";
+    double min_seconds = 0.5;
+    bool json = false;
+    bool verify = false;
+    string golden_dir = "sample_images";
+    int fuzz_images = 100;
+    unsigned int seed = 1300;
+    for(int i=1; i<argc; i++)
+    {
+        string option = argv[i];
+        bool has_value = i+1 < argc;
+        if(option == "--sample" && has_value)
+        {
+            sample_file = argv[++i];
+        }
+        else if(option == "--sizes" && has_value)
+        {
+            sizes = argv[++i];
+        }
+        else if(option == "--filter" && has_value)
+        {
+            filter = argv[++i];
+        }
+        else if(option == "--min-time" && has_value)
+        {
+            min_seconds = atof(argv[++i]);
+        }
+        else if(option == "--threads" && has_value)
+        {
+            set_thread_count(atoi(argv[++i]));
+        }
+        else if(option == "--tmp" && has_value)
+        {
+            tmp_dir = argv[++i];
+        }
+        else if(option == "--json")
+        {
+            json = true;
+        }
+        else if(option == "--verify")
+        {
+            verify = true;
+        }
+        else if(option == "--goldens" && has_value)
+        {
+            golden_dir = argv[++i];
+        }
+        else if(option == "--fuzz" && has_value)
+        {
+            fuzz_images = atoi(argv[++i]);
+        }
+        else if(option == "--seed" && has_value)
+        {
+            seed = strtoul(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            bool help = option == "--help";
+            if(!help)
+            {
+                cout << "Unknown option: " << option << endl;
+            }
+            cout << "Usage: " << argv[0] << " [--sample FILE] [--sizes sample,4k,8k,16k] [--filter TEXT]" << endl;
+            cout << "       [--min-time SECONDS] [--threads N] [--tmp DIR] [--json]" << endl;
+            cout << "   or: " << argv[0] << " --verify [--sample FILE] [--goldens DIR] [--fuzz N] [--seed S] [--tmp DIR]" << endl;
+            return help ? 0 : 1;
+        }
+    }
+
+    if(verify)
+    {
+        return run_verify(sample_file, golden_dir, fuzz_images, seed, tmp_dir) ? 0 : 1;
+    }
+
+    // Each size is set up, run and released before the next, to bound memory
+    vector<BenchResult> results;
+    if(!json)
+    {
+        cout << "Threads: " << configured_threads() << ", SIMD: " << simd_kernels().name << endl;
+        cout << left << setw(22) << "Benchmark" << right << setw(12) << "Time ms" << setw(12) << "CPU ms"
+             << setw(8) << "Runs" << setw(10) << "MP/s" << setw(12) << "MB/s" << setw(10) << "Allocs"
+             << setw(14) << "Alloc MB" << setw(10) << "Buffers" << endl;
+    }
+    stringstream size_list(sizes);
+    string label;
+    while(getline(size_list, label, ','))
+    {
+        shared_ptr<const Image> image;
+        if(label == "sample")
+        {
+            Image sample = read_packed_image(sample_file);
+            if(sample.width == 0)
+            {
+                cout << "Could not read " << sample_file << endl;
+                return 1;
+            }
+            image = make_shared<const Image>(move(sample));
+        }
+        else if(label == "4k")
+        {
+            image = make_shared<const Image>(make_noise_image(3840, 2160));
+        }
+        else if(label == "8k")
+        {
+            image = make_shared<const Image>(make_noise_image(7680, 4320));
+        }
+        else if(label == "16k")
+        {
+            image = make_shared<const Image>(make_noise_image(15360, 8640));
+        }
+        else
+        {
+            cout << "Unknown size: " << label << endl;
+            return 1;
+        }
+
+        vector<BenchCase> cases;
+        if(!add_size_cases(label, image, tmp_dir, cases))
+        {
+            cout << "Could not write to " << tmp_dir << endl;
+            return 1;
+        }
+        for(size_t i=0; i<cases.size(); i++)
+        {
+            if(cases[i].name.find(filter) == string::npos)
+            {
+                continue;
+            }
+            results.push_back(run_case(cases[i], min_seconds));
+            if(!json)
+            {
+                print_row(results.back());
+            }
+        }
+        unlink((tmp_dir + "/shepherd_bench_" + label + ".bmp").c_str());
+        unlink((tmp_dir + "/shepherd_bench_" + label + "_out.bmp").c_str());
+        for(int l=1; l<=PYRAMID_LEVELS; l++)
+        {
+            unlink(pyramid_level_name(tmp_dir + "/shepherd_bench_" + label + "_out.bmp", l).c_str());
+        }
+    }
+
+    if(json)
+    {
+        print_json(results, min_seconds);
+    }
+    return 0;
+}
@@ -21,6 +21,47 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <set>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <csignal>
+#include <glob.h>
+#include <climits>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define IMAGE_IO_URING
+#endif
+#endif
+#ifdef IMAGE_PROFILE
+#include <ctime>
+#include <sys/resource.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -235,322 +276,6583 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 
 
 
+// Stage profiling, compiled in with -DIMAGE_PROFILE and otherwise nothing at
+// all. Each PROFILE_SCOPE records one stage: its wall time, the process CPU
+// time (all threads, so scopes that overlap in a batch share it), the bytes
+// and pixels given by PROFILE_COUNTS and the peak resident set size when it
+// ended. PROFILE_RUN_END prints one summary line for the stages since the
+// last one. At exit the stages are written as a Chrome trace (chrome://tracing
+// or Perfetto) to $IMAGE_PROFILE_TRACE, by default image_profile.json.
+#ifdef IMAGE_PROFILE
+
+// One finished stage
+struct ProfileEvent
+{
+    string name;
+    int thread;             // Small number for the thread that ran it
+    long start_us;          // From the start of the program
+    long wall_us;
+    long cpu_us;
+    long bytes_in;
+    long bytes_out;
+    long pixels;
+    long peak_rss_kb;
+};
+
+// Every stage recorded so far, written out when the program ends
+struct ProfileLog
+{
+    mutex lock;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<ProfileEvent> events;
+    size_t summarized = 0;  // Events already in a summary line
+
+    ~ProfileLog();
+};
+
+ProfileLog& profile_log()
+{
+    static ProfileLog log;
+    return log;
+}
+
+// Process CPU time in microseconds
+long profile_cpu_us()
+{
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Numbers the threads in the order they first record a stage
+int profile_thread()
+{
+    static atomic<int> next(0);
+    static thread_local int id = next++;
+    return id;
+}
+
+// Records the stage it lives in from construction to destruction
+class ProfileScope
+{
+public:
+    explicit ProfileScope(string name)
+    {
+        profile_log();      // Starts the clock the events are timed from
+        event.name = name;
+        event.bytes_in = 0;
+        event.bytes_out = 0;
+        event.pixels = 0;
+        start = chrono::steady_clock::now();
+        event.cpu_us = profile_cpu_us();
+    }
+
+    ~ProfileScope()
+    {
+        ProfileLog& log = profile_log();
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        event.cpu_us = profile_cpu_us() - event.cpu_us;
+        event.wall_us = chrono::duration_cast<chrono::microseconds>(end - start).count();
+        event.start_us = chrono::duration_cast<chrono::microseconds>(start - log.start).count();
+        event.thread = profile_thread();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        event.peak_rss_kb = usage.ru_maxrss;
+        lock_guard<mutex> guard(log.lock);
+        log.events.push_back(event);
+    }
+
+    void counts(long bytes_in, long bytes_out, long pixels)
+    {
+        event.bytes_in = bytes_in;
+        event.bytes_out = bytes_out;
+        event.pixels = pixels;
+    }
+
+private:
+    ProfileEvent event;
+    chrono::steady_clock::time_point start;
+};
+
+/**
+ * Prints one line summing the stages recorded since the last summary:
+ * the time of each kind of stage, with its count if it ran more than once,
+ * then the totals
+ * @return nothing
+ */
+void print_profile_summary()
+{
+    ProfileLog& log = profile_log();
+    lock_guard<mutex> guard(log.lock);
+    if(log.summarized == log.events.size())
+    {
+        return;
+    }
+    stringstream line;
+    line << fixed << setprecision(2) << "Profile:";
+    long wall_us = 0;
+    long cpu_us = 0;
+    long bytes_in = 0;
+    long bytes_out = 0;
+    long pixels = 0;
+    long peak_rss_kb = 0;
+    vector<string> names;
+    vector<pair<int, long>> stages;     // Count and wall time by name
+    for(size_t i=log.summarized; i<log.events.size(); i++)
+    {
+        const ProfileEvent& event = log.events[i];
+        size_t k = find(names.begin(), names.end(), event.name) - names.begin();
+        if(k == names.size())
+        {
+            names.push_back(event.name);
+            stages.push_back(make_pair(0, 0L));
+        }
+        stages[k].first++;
+        stages[k].second += event.wall_us;
+        wall_us += event.wall_us;
+        cpu_us += event.cpu_us;
+        bytes_in += event.bytes_in;
+        bytes_out += event.bytes_out;
+        pixels += event.pixels;
+        peak_rss_kb = max(peak_rss_kb, event.peak_rss_kb);
+    }
+    log.summarized = log.events.size();
+    for(size_t k=0; k<names.size(); k++)
+    {
+        line << " " << names[k] << (stages[k].first > 1 ? " x" + to_string(stages[k].first) : "")
+             << " " << stages[k].second / 1000.0 << " ms,";
+    }
+    line << " total " << wall_us / 1000.0 << " ms wall, " << cpu_us / 1000.0 << " ms CPU, "
+         << bytes_in / 1e6 << " MB in, " << bytes_out / 1e6 << " MB out, "
+         << pixels / 1e6 << " MP, peak RSS " << peak_rss_kb / 1024.0 << " MB";
+    cout << line.str() << endl;
+}
+
+// Summarizes the last stages and writes the trace, one complete ("X") event
+// per stage with its counts as arguments
+ProfileLog::~ProfileLog()
+{
+    if(events.empty())
+    {
+        return;
+    }
+    print_profile_summary();
+    const char* trace_name = getenv("IMAGE_PROFILE_TRACE");
+    string filename = trace_name != nullptr ? trace_name : "image_profile.json";
+    ofstream trace(filename);
+    trace << "{\"traceEvents\": [" << endl;
+    for(size_t i=0; i<events.size(); i++)
+    {
+        const ProfileEvent& event = events[i];
+        string name = event.name;
+        for(size_t c=0; c<name.size(); c++)
+        {
+            if(name[c] == '"' || name[c] == '\\')
+            {
+                name[c] = '_';
+            }
+        }
+        trace << "  {\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+              << ", \"ts\": " << event.start_us << ", \"dur\": " << event.wall_us
+              << ", \"args\": {\"cpu_us\": " << event.cpu_us << ", \"bytes_in\": " << event.bytes_in
+              << ", \"bytes_out\": " << event.bytes_out << ", \"pixels\": " << event.pixels
+              << ", \"peak_rss_kb\": " << event.peak_rss_kb << "}}"
+              << (i+1 < events.size() ? "," : "") << endl;
+    }
+    trace << "]}" << endl;
+    cout << "Profile trace written to " << filename << endl;
+}
+
+#define PROFILE_SCOPE(name) ProfileScope profile_scope(name)
+#define PROFILE_COUNTS(bytes_in, bytes_out, pixels) profile_scope.counts(bytes_in, bytes_out, pixels)
+#define PROFILE_RUN_END() print_profile_summary()
+
+// A filter reading an image and writing `scale` times its pixels; bytes are
+// counted without row padding so mapped and packed inputs compare
+#define PROFILE_FILTER(name, image, scale) ProfileScope profile_scope(name); \
+    profile_scope.counts((long)(image).width * (image).height * 3, \
+                         (long)(image).width * (image).height * 3 * (scale), (long)(image).width * (image).height)
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_COUNTS(bytes_in, bytes_out, pixels)
+#define PROFILE_RUN_END()
+#define PROFILE_FILTER(name, image, scale)
+
+#endif
+
+
+// BMP header fields needed to locate and decode the pixel array
+struct BmpHeader
+{
+    long file_size;      // Up to 4 GB, the size fields are unsigned 32 bit
+    int start;
+    int width;
+    int height;          // Always positive, see top_down
+    bool top_down;       // True when the file stores rows top to bottom (negative height)
+    int bits_per_pixel;
+    int row_bytes;       // Scan line size including padding
+    int compression;     // BI_RGB, or BI_RLE8 or BI_RLE4 for paletted images
+    int palette_offset;  // File offset of the color table of a paletted image
+    int colors;          // Entries in the color table, 0 for 24 and 32 bit images
+};
+
+// BMP compression methods
+const int BI_RGB = 0;
+const int BI_RLE8 = 1;
+const int BI_RLE4 = 2;
+
+/**
+ * Gets a little-endian integer from a byte array.
+ * This is the buffer counterpart of get_int() used by the bulk reader
+ * @param arr    Array to read from
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to read
+ * @return the integer starting at the given offset
+ */
+int get_bytes(const unsigned char arr[], int offset, int bytes)
+{
+    unsigned int result = 0;
+    for(int i=0; i<bytes; i++)
+    {
+        result = result | ((unsigned int)arr[offset+i] << (i*8));
+    }
+    return (int)result;
+}
+
+/**
+ * Parses and validates the BMP and DIB headers
+ * @param bytes  The first 54 bytes of the file
+ * @param header the parsed header
+ * @return True if this is a 24 or 32 bit image whose size matches its
+ *         header, or a 1, 4 or 8 bit paletted one, possibly RLE compressed
+ */
+bool parse_bmp_header(const unsigned char bytes[], BmpHeader& header)
+{
+    if(bytes[0] != 'B' || bytes[1] != 'M')
+    {
+        return false;
+    }
+
+    header.file_size = (unsigned int)get_bytes(bytes, 2, 4);
+    header.start = get_bytes(bytes, 10, 4);
+    header.width = get_bytes(bytes, 18, 4);
+    int height = get_bytes(bytes, 22, 4);
+    if(height == INT_MIN)
+    {
+        // Has no positive counterpart
+        return false;
+    }
+    header.top_down = height < 0;
+    header.height = header.top_down ? -height : height;
+    header.bits_per_pixel = get_bytes(bytes, 28, 2);
+    header.compression = get_bytes(bytes, 30, 4);
+    int dib_header_size = get_bytes(bytes, 14, 4);
+    header.colors = 0;
+    int bits = header.bits_per_pixel;
+
+    if(header.width <= 0 || header.height <= 0 || dib_header_size < 40 || header.start < 14L + dib_header_size)
+    {
+        return false;
+    }
+    header.palette_offset = 14 + dib_header_size;
+
+    // Rows of up to 32 bits per pixel must fit an int, and the image decoded
+    // to 24 bits must still fit in a BMP
+    if(header.width > (INT_MAX - 3) / 4 || 54 + (header.width * 3L + 3) / 4 * 4 * header.height > 0xffffffffL)
+    {
+        return false;
+    }
+    bool rle = (header.compression == BI_RLE8 && bits == 8) || (header.compression == BI_RLE4 && bits == 4);
+    if(bits == 1 || bits == 4 || bits == 8)
+    {
+        // Compressed bitmaps are always bottom-up
+        if((header.compression != BI_RGB && !rle) || (rle && header.top_down))
+        {
+            return false;
+        }
+        int colors_used = get_bytes(bytes, 46, 4);
+        header.colors = colors_used == 0 ? 1 << bits : colors_used;
+        if(header.colors < 1 || header.colors > (1 << bits)
+            || header.palette_offset + 4L * header.colors > header.start)
+        {
+            return false;
+        }
+    }
+    else if(bits != 24 && bits != 32)
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    int scanline_size = (int)(((long)header.width * bits + 7) / 8);
+    header.row_bytes = scanline_size + (4 - scanline_size % 4) % 4;
+
+    // The size of a compressed pixel array depends on its contents
+    if(rle)
+    {
+        return header.file_size > header.start;
+    }
+    return header.file_size == header.start + (long)header.row_bytes * header.height;
+}
+
+/**
+ * Reads and validates the BMP and DIB headers with a single read
+ * @param stream the open binary stream, positioned anywhere
+ * @param header the parsed header
+ * @return True if the image is one parse_bmp_header() accepts
+ */
+bool read_bmp_header(fstream& stream, BmpHeader& header)
+{
+    const int HEADER_SIZE = 54;
+    unsigned char bytes[HEADER_SIZE] = {0};
+    stream.seekg(0);
+    stream.read((char*)bytes, HEADER_SIZE);
+    return stream.gcount() == HEADER_SIZE && parse_bmp_header(bytes, header);
+}
+
+// Read-only view of a BMP file mapped straight into memory
+// Rows are addressed top to bottom through row_step, which is negative for
+// the usual bottom-up files, so filters never need a decoded copy
+struct MappedImage
+{
+    const unsigned char* top_row;   // First byte of row 0 (the top of the image)
+    long row_step;                  // Bytes from row r to row r+1
+    int width;
+    int height;
+    int bytes_per_pixel;            // 3 for BGR, 4 for BGRA
+    void* map_base;
+    size_t map_size;
+};
+
+/**
+ * Maps the BMP image specified read-only into memory
+ * @param filename BMP image filename
+ * @param view     The resulting view over the file's pixel rows
+ * @return True if the file is a valid 24 or 32 bit image and was mapped
+ */
+bool map_image(string filename, MappedImage& view)
+{
+    view.map_base = nullptr;
+    view.map_size = 0;
+
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    BmpHeader header;
+    if(!stream.is_open() || !read_bmp_header(stream, header) || header.bits_per_pixel < 24)
+    {
+        return false;
+    }
+    stream.close();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size < header.file_size)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* base = mmap(nullptr, header.file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        return false;
+    }
+    // Filters walk the rows in order, so let the kernel read ahead
+    madvise(base, header.file_size, MADV_SEQUENTIAL);
+
+    const unsigned char* pixels = (const unsigned char*)base + header.start;
+    view.width = header.width;
+    view.height = header.height;
+    view.bytes_per_pixel = header.bits_per_pixel / 8;
+    view.map_base = base;
+    view.map_size = header.file_size;
+    if(header.top_down)
+    {
+        view.top_row = pixels;
+        view.row_step = header.row_bytes;
+    }
+    else
+    {
+        view.top_row = pixels + (long)(header.height - 1) * header.row_bytes;
+        view.row_step = -(long)header.row_bytes;
+    }
+    return true;
+}
+
+/**
+ * Releases a view created by map_image()
+ * @param view The view to unmap
+ * @return nothing
+ */
+void unmap_image(MappedImage& view)
+{
+    if(view.map_base != nullptr)
+    {
+        munmap(view.map_base, view.map_size);
+        view.map_base = nullptr;
+    }
+}
+
+// Returns the blue, green, red bytes of the pixel at row r, column c
+inline const unsigned char* pixel_at(const MappedImage& view, int r, int c)
+{
+    return view.top_row + r * view.row_step + (long)c * view.bytes_per_pixel;
+}
+
+
+// Largest total size of the free buffers the pool keeps for reuse
+const long BUFFER_POOL_MEGABYTES = 256;
+
+// Buffers handed out by the pool, for checking that a steady stream of
+// frames reuses its buffers
+struct BufferPoolStats
+{
+    long allocated;     // Buffers that needed new memory
+    long reused;        // Buffers served from the free lists
+    long cached_bytes;  // Memory in the free lists now
+};
+
+/**
+ * Rounds a buffer size up to its pool size class
+ * Classes are eight even steps between powers of two, so at most an eighth
+ * is wasted, and are whole multiples of 64 bytes
+ * @param bytes Bytes wanted
+ * @return bytes in the size class
+ */
+size_t buffer_class_bytes(size_t bytes)
+{
+    if(bytes <= 512)
+    {
+        return (bytes + 63) / 64 * 64;
+    }
+    int bits = 0;
+    while(((size_t)1 << (bits + 1)) < bytes)
+    {
+        bits++;
+    }
+    size_t step = (size_t)1 << (bits - 3);
+    return (bytes + step - 1) / step * step;
+}
+
+// Recycles image memory by size class. A released buffer waits in the free
+// list of its class for the next image of about the same size, so a run of
+// same-sized frames stops allocating after the first few. Buffers come back
+// uninitialized and aligned to 64 bytes, a cache line and an AVX-512 vector.
+class BufferPool
+{
+public:
+    BufferPool()
+    {
+        stats.allocated = 0;
+        stats.reused = 0;
+        stats.cached_bytes = 0;
+    }
+
+    /**
+     * Hands out a buffer of at least the given size
+     * @param bytes    Bytes wanted, more than zero
+     * @param capacity Set to the size of its class, to give back to release()
+     * @return the buffer; throws bad_alloc if memory is exhausted
+     */
+    unsigned char* acquire(size_t bytes, size_t& capacity)
+    {
+        capacity = buffer_class_bytes(bytes);
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            vector<unsigned char*>& blocks = free_blocks[capacity];
+            if(!blocks.empty())
+            {
+                unsigned char* block = blocks.back();
+                blocks.pop_back();
+                stats.reused++;
+                stats.cached_bytes -= capacity;
+                return block;
+            }
+            stats.allocated++;
+        }
+        void* block = nullptr;
+        if(posix_memalign(&block, 64, capacity) != 0)
+        {
+            throw bad_alloc();
+        }
+        return (unsigned char*)block;
+    }
+
+    /**
+     * Takes a buffer back, keeping it for reuse unless the pool is full
+     * @param block    A buffer from acquire()
+     * @param capacity Its capacity
+     * @return nothing
+     */
+    void release(unsigned char* block, size_t capacity)
+    {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            if(stats.cached_bytes + (long)capacity <= BUFFER_POOL_MEGABYTES << 20)
+            {
+                free_blocks[capacity].push_back(block);
+                stats.cached_bytes += capacity;
+                return;
+            }
+        }
+        free(block);
+    }
+
+    BufferPoolStats counts()
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        return stats;
+    }
+
+private:
+    mutex pool_mutex;
+    map<size_t, vector<unsigned char*>> free_blocks;    // By capacity
+    BufferPoolStats stats;
+};
+
+// The pool every image buffer comes from. It is never destroyed, so images
+// in static storage can still release their buffers at exit.
+BufferPool& buffer_pool()
+{
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+/**
+ * Reports how many buffers have been allocated and reused so far
+ * @return the pool counters
+ */
+BufferPoolStats buffer_pool_stats()
+{
+    return buffer_pool().counts();
+}
+
+// Pixel memory of an image, on loan from the buffer pool
+// Copies get their own buffer; moves hand the buffer over. New and resized
+// buffers are uninitialized.
+class PixelBuffer
+{
+public:
+    PixelBuffer() : bytes(nullptr), length(0), capacity(0)
+    {
+    }
+
+    PixelBuffer(const PixelBuffer& other) : bytes(nullptr), length(0), capacity(0)
+    {
+        reset(other.length);
+        if(length > 0)
+        {
+            memcpy(bytes, other.bytes, length);
+        }
+    }
+
+    PixelBuffer(PixelBuffer&& other) noexcept : bytes(other.bytes), length(other.length), capacity(other.capacity)
+    {
+        other.bytes = nullptr;
+        other.length = 0;
+        other.capacity = 0;
+    }
+
+    PixelBuffer& operator=(const PixelBuffer& other)
+    {
+        if(this != &other)
+        {
+            reset(other.length);
+            if(length > 0)
+            {
+                memcpy(bytes, other.bytes, length);
+            }
+        }
+        return *this;
+    }
+
+    PixelBuffer& operator=(PixelBuffer&& other) noexcept
+    {
+        if(this != &other)
+        {
+            give_back();
+            swap(bytes, other.bytes);
+            swap(length, other.length);
+            swap(capacity, other.capacity);
+        }
+        return *this;
+    }
+
+    ~PixelBuffer()
+    {
+        give_back();
+    }
+
+    unsigned char* data()
+    {
+        return bytes;
+    }
+
+    const unsigned char* data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    /**
+     * Changes the size, keeping the memory if it is large enough and
+     * not much too large; the contents are not kept
+     * @param size New size in bytes
+     * @return nothing
+     */
+    void reset(size_t size)
+    {
+        if(size > capacity || buffer_class_bytes(size) < capacity)
+        {
+            give_back();
+            if(size > 0)
+            {
+                // Left empty if the allocation throws
+                size_t new_capacity = 0;
+                bytes = buffer_pool().acquire(size, new_capacity);
+                capacity = new_capacity;
+            }
+        }
+        length = size;
+    }
+
+private:
+    void give_back()
+    {
+        if(bytes != nullptr)
+        {
+            buffer_pool().release(bytes, capacity);
+        }
+        bytes = nullptr;
+        length = 0;
+        capacity = 0;
+    }
+
+    unsigned char* bytes;
+    size_t length;
+    size_t capacity;
+};
+
+// Image stored in one contiguous buffer of 8 bit channels
+// Rows run top to bottom and keep the blue, green, red order and 4 byte row
+// padding of the BMP file, so a row is exactly one scan line.
+struct Image
+{
+    int width;
+    int height;
+    int stride;             // Bytes from one row to the next
+    PixelBuffer data;
+};
+
+/**
+ * Creates a black image of the given size
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @return the new image
+ */
+Image make_image(int width, int height)
+{
+    Image image;
+    image.width = width;
+    image.height = height;
+    int row_size = width * 3;
+    image.stride = row_size + (4 - row_size % 4) % 4;
+    image.data.reset((size_t)image.stride * height);
+    if(image.data.size() > 0)
+    {
+        memset(image.data.data(), 0, image.data.size());
+    }
+    return image;
+}
+
+/**
+ * Gives an image a new size for a filter that writes every pixel
+ * The buffer is kept if it is about the right size, else swapped for one
+ * from the pool. Pixels are left as they are; only the row padding, which
+ * no filter writes, is cleared.
+ * @param image  The image to reshape
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @return nothing
+ */
+void shape_image(Image& image, int width, int height)
+{
+    image.width = width;
+    image.height = height;
+    int row_size = width * 3;
+    image.stride = row_size + (4 - row_size % 4) % 4;
+    image.data.reset((size_t)image.stride * height);
+    if(image.stride > row_size)
+    {
+        for(int r=0; r<height; r++)
+        {
+            memset(image.data.data() + (size_t)r * image.stride + row_size, 0, image.stride - row_size);
+        }
+    }
+}
+
+/**
+ * Creates an image whose pixels a filter is about to overwrite
+ * @param width  Width in pixels
+ * @param height Height in pixels
+ * @return the new image, pixels uninitialized and row padding zero
+ */
+Image make_uninitialized_image(int width, int height)
+{
+    Image image;
+    shape_image(image, width, height);
+    return image;
+}
+
+// Returns the first byte of row r
+inline unsigned char* image_row(Image& image, int r)
+{
+    return image.data.data() + (size_t)r * image.stride;
+}
+
+inline const unsigned char* image_row(const Image& image, int r)
+{
+    return image.data.data() + (size_t)r * image.stride;
+}
+
+/**
+ * Copies a vector of vector of Pixels into a packed image
+ * Color values are stored as bytes, the same truncation write_image() applies
+ * @param image The image as a vector of vector of Pixels
+ * @return the packed image
+ */
+Image to_image(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = height > 0 ? image[0].size() : 0;
+    Image packed = make_uninitialized_image(width, height);
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* pixel = image_row(packed, r);
+        for(int c=0; c<width; c++)
+        {
+            pixel[0] = image[r][c].blue;
+            pixel[1] = image[r][c].green;
+            pixel[2] = image[r][c].red;
+            pixel += 3;
+        }
+    }
+    return packed;
+}
+
+/**
+ * Copies a packed image into a vector of vector of Pixels
+ * @param image The packed image
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> to_pixels(const Image& image)
+{
+    vector<vector<Pixel>> pixels(image.height, vector<Pixel> (image.width));
+    for(int r=0; r<image.height; r++)
+    {
+        const unsigned char* pixel = image_row(image, r);
+        for(int c=0; c<image.width; c++)
+        {
+            pixels[r][c].blue = pixel[0];
+            pixels[r][c].green = pixel[1];
+            pixels[r][c].red = pixel[2];
+            pixel += 3;
+        }
+    }
+    return pixels;
+}
+
+/**
+ * Decodes the pixel array of a 1, 4 or 8 bit paletted BMP, uncompressed or
+ * RLE8 or RLE4 compressed
+ * @param header  The parsed header
+ * @param palette The color table: blue, green, red and a spare byte for
+ *                each of header.colors colors
+ * @param pixels  The pixel array
+ * @param size    Bytes of pixel array available
+ * @param result  Destination already shaped to the image
+ * @return True if the pixel array is complete and well formed
+ */
+bool decode_paletted_pixels(const BmpHeader& header, const unsigned char* palette,
+                            const unsigned char* pixels, size_t size, Image& result)
+{
+    // Indexes past the end of the table are black
+    unsigned char colors[256][3] = {{0}};
+    for(int i=0; i<header.colors; i++)
+    {
+        colors[i][0] = palette[4*i];
+        colors[i][1] = palette[4*i + 1];
+        colors[i][2] = palette[4*i + 2];
+    }
+    int bits = header.bits_per_pixel;
+
+    if(header.compression == BI_RGB)
+    {
+        if(size < (size_t)header.row_bytes * header.height)
+        {
+            return false;
+        }
+        for(int file_row=0; file_row<header.height; file_row++)
+        {
+            int r = header.top_down ? file_row : header.height - 1 - file_row;
+            const unsigned char* src = pixels + (size_t)file_row * header.row_bytes;
+            unsigned char* row = image_row(result, r);
+            for(int c=0; c<header.width; c++)
+            {
+                // Pixels are packed from the high bits of each byte down
+                int index = bits == 8 ? src[c]
+                          : bits == 4 ? (src[c >> 1] >> (c & 1 ? 0 : 4)) & 15
+                          : (src[c >> 3] >> (7 - (c & 7))) & 1;
+                memcpy(row + 3*c, colors[index], 3);
+            }
+        }
+        return true;
+    }
+
+    // Run-length encoded bitmaps are stored bottom-up. Pixels a delta or an
+    // early end of line skips take the first color.
+    for(int r=0; r<header.height; r++)
+    {
+        unsigned char* row = image_row(result, r);
+        for(int c=0; c<header.width; c++)
+        {
+            memcpy(row + 3*c, colors[0], 3);
+        }
+    }
+    int file_row = 0;
+    int c = 0;
+    size_t i = 0;
+    while(i + 1 < size && file_row < header.height)
+    {
+        int count = pixels[i];
+        int value = pixels[i + 1];
+        i += 2;
+        unsigned char* row = image_row(result, header.height - 1 - file_row);
+        if(count > 0)
+        {
+            // A run of one index, or for RLE4 two alternating ones
+            for(int k=0; k<count && c<header.width; k++, c++)
+            {
+                int index = bits == 8 ? value : (k & 1 ? value & 15 : value >> 4);
+                memcpy(row + 3*c, colors[index], 3);
+            }
+        }
+        else if(value == 0)
+        {
+            file_row++;
+            c = 0;
+        }
+        else if(value == 1)
+        {
+            return true;
+        }
+        else if(value == 2)
+        {
+            if(i + 1 >= size)
+            {
+                return false;
+            }
+            c += pixels[i];
+            file_row += pixels[i + 1];
+            i += 2;
+        }
+        else
+        {
+            // `value` indexes stored as they are, padded to a 16 bit boundary
+            size_t bytes = bits == 8 ? value : (value + 1) / 2;
+            if(i + bytes > size)
+            {
+                return false;
+            }
+            for(int k=0; k<value && c<header.width; k++, c++)
+            {
+                int index = bits == 8 ? pixels[i + k] : (k & 1 ? pixels[i + k/2] & 15 : pixels[i + k/2] >> 4);
+                memcpy(row + 3*c, colors[index], 3);
+            }
+            i += bytes + (bytes & 1);
+        }
+    }
+    // Some encoders end on the last end of line instead of an end of bitmap
+    return file_row >= header.height - 1;
+}
+
+/**
+ * Reads the BMP image specified into a packed image
+ * 24 bit scan lines are read straight into their rows, padding included.
+ * The image keeps its buffer if it already has the file's size.
+ * @param filename BMP image filename
+ * @param result   The image to read into, left empty if not a valid image
+ * @return True if successful and false otherwise
+ */
+bool read_packed_image(string filename, Image& result)
+{
+    PROFILE_SCOPE("decode");
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    BmpHeader header;
+    if(!stream.is_open() || !read_bmp_header(stream, header))
+    {
+        shape_image(result, 0, 0);
+        return false;
+    }
+
+    shape_image(result, header.width, header.height);
+    if(header.bits_per_pixel < 24)
+    {
+        // The color table and the pixels, read whatever their compressed size
+        stream.seekg(0, ios::end);
+        long size = (long)stream.tellg() - header.palette_offset;
+        PixelBuffer bytes;
+        bytes.reset(max(0L, size));
+        stream.seekg(header.palette_offset);
+        stream.read((char*)bytes.data(), bytes.size());
+        int pixels = header.start - header.palette_offset;
+        if(stream.gcount() != (long)bytes.size() || size < pixels
+            || !decode_paletted_pixels(header, bytes.data(), bytes.data() + pixels, size - pixels, result))
+        {
+            shape_image(result, 0, 0);
+            return false;
+        }
+        PROFILE_COUNTS(header.start + size - pixels, (long)result.stride * result.height, (long)result.width * result.height);
+        return true;
+    }
+    vector<unsigned char> scanline(header.bits_per_pixel == 32 ? header.row_bytes : 0);
+    stream.seekg(header.start);
+
+    for(int file_row=0; file_row<header.height; file_row++)
+    {
+        int r = header.top_down ? file_row : header.height - 1 - file_row;
+        unsigned char* row = image_row(result, r);
+        if(header.bits_per_pixel == 24)
+        {
+            stream.read((char*)row, header.row_bytes);
+        }
+        else
+        {
+            // Drop the alpha byte of each BGRA pixel
+            stream.read((char*)scanline.data(), header.row_bytes);
+            const unsigned char* src = scanline.data();
+            for(int c=0; c<header.width; c++)
+            {
+                row[0] = src[0];
+                row[1] = src[1];
+                row[2] = src[2];
+                row += 3;
+                src += 4;
+            }
+        }
+        if(stream.gcount() != header.row_bytes)
+        {
+            shape_image(result, 0, 0);
+            return false;
+        }
+    }
+
+    // Padding bytes in the file are not required to be zero
+    int used = header.width * 3;
+    for(int r=0; r<header.height && used<result.stride; r++)
+    {
+        fill(image_row(result, r) + used, image_row(result, r) + result.stride, 0);
+    }
+
+    stream.close();
+    PROFILE_COUNTS(header.file_size, (long)result.stride * result.height, (long)result.width * result.height);
+    return true;
+}
+
+/**
+ * Decodes a BMP file held in memory into a packed image
+ * @param bytes  The whole file
+ * @param size   Its size in bytes
+ * @param result The image to decode into, left empty if not a valid image
+ * @return True if successful and false otherwise
+ */
+bool decode_packed_image(const unsigned char* bytes, size_t size, Image& result)
+{
+    PROFILE_SCOPE("decode");
+    BmpHeader header;
+    if(size < 54 || !parse_bmp_header(bytes, header) || header.start < 54 || (size_t)header.file_size > size)
+    {
+        shape_image(result, 0, 0);
+        return false;
+    }
+
+    shape_image(result, header.width, header.height);
+    if(header.bits_per_pixel < 24)
+    {
+        if(!decode_paletted_pixels(header, bytes + header.palette_offset, bytes + header.start,
+                                    size - header.start, result))
+        {
+            shape_image(result, 0, 0);
+            return false;
+        }
+        PROFILE_COUNTS(size, (long)result.stride * result.height, (long)result.width * result.height);
+        return true;
+    }
+    int used = header.width * 3;
+    for(int file_row=0; file_row<header.height; file_row++)
+    {
+        int r = header.top_down ? file_row : header.height - 1 - file_row;
+        unsigned char* row = image_row(result, r);
+        const unsigned char* src = bytes + header.start + (long)file_row * header.row_bytes;
+        if(header.bits_per_pixel == 24)
+        {
+            memcpy(row, src, used);
+        }
+        else
+        {
+            // Drop the alpha byte of each BGRA pixel
+            for(int c=0; c<header.width; c++)
+            {
+                row[0] = src[0];
+                row[1] = src[1];
+                row[2] = src[2];
+                row += 3;
+                src += 4;
+            }
+        }
+        fill(image_row(result, r) + used, image_row(result, r) + result.stride, 0);
+    }
+    PROFILE_COUNTS(header.file_size, (long)result.stride * result.height, (long)result.width * result.height);
+    return true;
+}
+
+/**
+ * Reads the BMP image specified into a packed image
+ * @param filename BMP image filename
+ * @return the packed image, with zero width and height if not a valid image
+ */
+Image read_packed_image(string filename)
+{
+    Image image;
+    read_packed_image(filename, image);
+    return image;
+}
+
+/**
+ * Fills in the 54 byte BMP and DIB headers of a 24 bit image, the same
+ * headers write_image() produces
+ * @param header Array of at least 54 bytes, all zero
+ * @param width  Width of bitmap in pixels
+ * @param height Height of bitmap in pixels
+ * @return the total file size in bytes, which only fits the headers up to 4 GB
+ */
+long set_bmp_headers(unsigned char header[], int width, int height)
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    int width_bytes = width * 3;
+    width_bytes = width_bytes + (4 - width_bytes % 4) % 4;
+    long array_bytes = (long)width_bytes * height;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(header,  0, 1, 'B');                  // ID field
+    set_bytes(header,  1, 1, 'M');                  // ID field
+    set_bytes(header,  2, 4, (int)(BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes)); // Size of BMP file
+    set_bytes(header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width);            // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height);           // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
+    set_bytes(dib_header, 20, 4, (int)array_bytes); // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+
+    return BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes;
+}
+
+/**
+ * Writes a list of buffers to a file descriptor, retrying short writes
+ * @param fd    The open file descriptor
+ * @param parts The buffers to write, in order (may be modified)
+ * @return True if every byte was written
+ */
+bool write_all(int fd, vector<struct iovec>& parts)
+{
+    size_t next = 0;
+    while(next < parts.size())
+    {
+        int count = (int)min(parts.size() - next, (size_t)IOV_MAX);
+        ssize_t written = writev(fd, &parts[next], count);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        // Skip the buffers that were fully written, trim a partial one
+        while(next < parts.size() && (size_t)written >= parts[next].iov_len)
+        {
+            written -= parts[next].iov_len;
+            next++;
+        }
+        if(next < parts.size())
+        {
+            parts[next].iov_base = (char*)parts[next].iov_base + written;
+            parts[next].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads into a list of buffers from a file descriptor, retrying short reads
+ * @param fd    The open file descriptor
+ * @param parts The buffers to fill, in order (may be modified)
+ * @return True if every buffer was filled before the end of the file
+ */
+bool read_all(int fd, vector<struct iovec>& parts)
+{
+    size_t next = 0;
+    while(next < parts.size())
+    {
+        int count = (int)min(parts.size() - next, (size_t)IOV_MAX);
+        ssize_t got = readv(fd, &parts[next], count);
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got <= 0)
+        {
+            return false;
+        }
+
+        // Skip the buffers that were filled, trim a partial one
+        while(next < parts.size() && (size_t)got >= parts[next].iov_len)
+        {
+            got -= parts[next].iov_len;
+            next++;
+        }
+        if(next < parts.size())
+        {
+            parts[next].iov_base = (char*)parts[next].iov_base + got;
+            parts[next].iov_len -= got;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads or writes a list of buffers at a file offset, retrying short
+ * transfers, without moving the file position
+ * @param write  True to write the buffers, false to fill them
+ * @param fd     The open file descriptor
+ * @param offset File offset of the first byte
+ * @param parts  The buffers, in order (may be modified)
+ * @return True if every byte was transferred before the end of the file
+ */
+bool transfer_at(bool write, int fd, off_t offset, vector<struct iovec>& parts)
+{
+    size_t next = 0;
+    while(next < parts.size())
+    {
+        int count = (int)min(parts.size() - next, (size_t)IOV_MAX);
+        ssize_t done = write ? pwritev(fd, &parts[next], count, offset) : preadv(fd, &parts[next], count, offset);
+        if(done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(done < 0 || (done == 0 && !write))
+        {
+            return false;
+        }
+        offset += done;
+
+        // Skip the buffers that were fully transferred, trim a partial one
+        while(next < parts.size() && (size_t)done >= parts[next].iov_len)
+        {
+            done -= parts[next].iov_len;
+            next++;
+        }
+        if(next < parts.size())
+        {
+            parts[next].iov_base = (char*)parts[next].iov_base + done;
+            parts[next].iov_len -= done;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes a packed interleaved image as a 24 bit BMP to an open file or socket
+ * @param fd       The open file descriptor
+ * @param image    The image to save
+ * @param preamble Bytes to send ahead of the BMP in the same writev() calls
+ * @return True if every byte was written
+ */
+bool write_packed_image(int fd, const Image& image, const string& preamble)
+{
+    PROFILE_SCOPE("encode");
+    unsigned char header[54] = {0};
+    set_bmp_headers(header, image.width, image.height);
+    PROFILE_COUNTS((long)image.stride * image.height, sizeof(header) + (long)image.stride * image.height,
+                   (long)image.width * image.height);
+
+    // Preamble and headers first, then rows bottom to top
+    vector<struct iovec> parts(image.height + 2);
+    parts[0].iov_base = (void*)preamble.data();
+    parts[0].iov_len = preamble.size();
+    parts[1].iov_base = header;
+    parts[1].iov_len = sizeof(header);
+    for(int r=0; r<image.height; r++)
+    {
+        parts[image.height + 1 - r].iov_base = (void*)image_row(image, r);
+        parts[image.height + 1 - r].iov_len = image.stride;
+    }
+    return write_all(fd, parts);
+}
+
+/**
+ * Writes a packed image to a 24 bit BMP file
+ * Rows already carry their zero padding, so the headers and every scan
+ * line go out through writev() without being copied
+ * @param filename The BMP file name to save the image to
+ * @param image    The image to save
+ * @return True if successful and false otherwise
+ */
+bool write_packed_image(string filename, const Image& image)
+{
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        return false;
+    }
+    bool success = write_packed_image(fd, image, "");
+    return close(fd) == 0 && success;
+}
+
+/**
+ * Writes a packed image to a 24 bit BMP file through a shared mapping
+ * The file is sized up front and the scan lines are copied straight into
+ * the page cache, with no write calls at all
+ * @param filename The BMP file name to save the image to
+ * @param image    The image to save
+ * @return True if successful and false otherwise
+ */
+bool write_packed_image_mmap(string filename, const Image& image)
+{
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    unsigned char header[54] = {0};
+    size_t file_size = set_bmp_headers(header, image.width, image.height);
+    if(ftruncate(fd, file_size) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    void* base = mmap(nullptr, file_size, PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    unsigned char* out = (unsigned char*)base;
+    memcpy(out, header, sizeof(header));
+    out += sizeof(header);
+    for(int r=image.height-1; r>=0; r--)
+    {
+        memcpy(out, image_row(image, r), image.stride);
+        out += image.stride;
+    }
+
+    bool success = munmap(base, file_size) == 0;
+    return close(fd) == 0 && success;
+}
+
+// Results with at most this many colors can be written as paletted BMPs
+const int PALETTE_COLORS = 256;
+
+// Palette indexes by color, in an open-addressed table four times the
+// largest palette
+struct ColorTable
+{
+    unsigned int keys[4 * PALETTE_COLORS];      // Color plus one, 0 when free
+    unsigned char indexes[4 * PALETTE_COLORS];
+    vector<unsigned int> colors;                // Blue, green and red, in order of first use
+};
+
+/**
+ * Finds a color's palette index, adding it if it is new
+ * @param table The table
+ * @param color Blue in the low byte, then green and red
+ * @return the index, or -1 if the palette is already full
+ */
+inline int color_index(ColorTable& table, unsigned int color)
+{
+    const unsigned int SLOTS = 4 * PALETTE_COLORS;
+    unsigned int slot = (color * 2654435761u) >> 22;
+    while(table.keys[slot] != 0)
+    {
+        if(table.keys[slot] == color + 1)
+        {
+            return table.indexes[slot];
+        }
+        slot = (slot + 1) % SLOTS;
+    }
+    if((int)table.colors.size() == PALETTE_COLORS)
+    {
+        return -1;
+    }
+    table.keys[slot] = color + 1;
+    table.indexes[slot] = table.colors.size();
+    table.colors.push_back(color);
+    return table.indexes[slot];
+}
+
+/**
+ * Run-length encodes one row of palette indexes for BI_RLE8 or BI_RLE4
+ * Runs of three or more equal pixels become encoded runs; other pixels go
+ * in absolute runs, or as runs of one (or for RLE4 of two different pixels)
+ * when there are fewer than three of them
+ * @param row   The indexes
+ * @param width Pixels in the row
+ * @param bits  8 or 4
+ * @param out   The encoded bytes are appended here
+ * @return nothing
+ */
+void rle_encode_row(const unsigned char* row, int width, int bits, vector<unsigned char>& out)
+{
+    int c = 0;
+    while(c < width)
+    {
+        int run = 1;
+        while(c + run < width && run < 255 && row[c + run] == row[c])
+        {
+            run++;
+        }
+        if(run >= 3)
+        {
+            out.push_back(run);
+            out.push_back(bits == 8 ? row[c] : (row[c] << 4) | row[c]);
+            c += run;
+            continue;
+        }
+
+        // Up to the next run of three
+        int end = c;
+        while(end < width && end - c < 255
+               && !(end + 2 < width && row[end] == row[end + 1] && row[end] == row[end + 2]))
+        {
+            end++;
+        }
+        int count = end - c;
+        if(count >= 3)
+        {
+            out.push_back(0);
+            out.push_back(count);
+            size_t first = out.size();
+            for(int k=0; k<count; k++)
+            {
+                if(bits == 8)
+                {
+                    out.push_back(row[c + k]);
+                }
+                else if(k % 2 == 0)
+                {
+                    out.push_back(row[c + k] << 4);
+                }
+                else
+                {
+                    out.back() |= row[c + k];
+                }
+            }
+            if((out.size() - first) % 2 == 1)
+            {
+                out.push_back(0);
+            }
+        }
+        else if(bits == 4 && count == 2)
+        {
+            out.push_back(2);
+            out.push_back((row[c] << 4) | row[c + 1]);
+        }
+        else
+        {
+            for(int k=0; k<count; k++)
+            {
+                out.push_back(1);
+                out.push_back(bits == 8 ? row[c + k] : (row[c + k] << 4) | row[c + k]);
+            }
+        }
+        c = end;
+    }
+}
+
+/**
+ * Encodes an image with few colors as a paletted BMP file: 1 bit for two
+ * colors, otherwise 4 bit up to 16 colors and 8 bit up to 256, RLE4 or
+ * RLE8 compressed when that is smaller
+ * @param image The image
+ * @param file  The whole BMP file
+ * @return False if the image has more than PALETTE_COLORS colors
+ */
+bool encode_paletted_image(const Image& image, vector<unsigned char>& file)
+{
+    PROFILE_SCOPE("encode paletted");
+    int width = image.width;
+    int height = image.height;
+
+    // Palette indexes, bottom row first as the file stores them
+    unique_ptr<ColorTable> table(new ColorTable());
+    memset(table->keys, 0, sizeof(table->keys));
+    PixelBuffer indexes;
+    indexes.reset((size_t)width * height);
+    for(int r=0; r<height; r++)
+    {
+        const unsigned char* pixel = image_row(image, r);
+        unsigned char* index = indexes.data() + (size_t)(height - 1 - r) * width;
+        unsigned int last_color = 0;
+        int last_index = -1;
+        for(int c=0; c<width; c++)
+        {
+            unsigned int color = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+            if(last_index < 0 || color != last_color)
+            {
+                last_index = color_index(*table, color);
+                if(last_index < 0)
+                {
+                    return false;
+                }
+                last_color = color;
+            }
+            index[c] = last_index;
+            pixel += 3;
+        }
+    }
+
+    int colors = table->colors.size();
+    int bits = colors <= 2 ? 1 : (colors <= 16 ? 4 : 8);
+    int row_bytes = (width * bits + 31) / 32 * 4;
+    long raw_bytes = (long)row_bytes * height;
+
+    // Headers and color table, then the pixels go straight after them
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    int start = BMP_HEADER_SIZE + DIB_HEADER_SIZE + 4 * colors;
+    file.assign(start, 0);
+    file.reserve(start + raw_bytes + 2L * width + 2);     // Room for the row that makes RLE give up
+
+    // Compressed when that is smaller, stopping as soon as it is not
+    int compression = BI_RGB;
+    if(bits != 1)
+    {
+        for(int r=0; r<height && (long)file.size() - start < raw_bytes; r++)
+        {
+            rle_encode_row(indexes.data() + (size_t)r * width, width, bits, file);
+            file.push_back(0);
+            file.push_back(r == height - 1 ? 1 : 0);       // End of line, or of the bitmap
+        }
+        if((long)file.size() - start < raw_bytes)
+        {
+            compression = bits == 8 ? BI_RLE8 : BI_RLE4;
+        }
+    }
+    if(compression == BI_RGB)
+    {
+        file.resize(start);
+        file.resize(start + raw_bytes, 0);
+        for(int r=0; r<height; r++)
+        {
+            const unsigned char* index = indexes.data() + (size_t)r * width;
+            unsigned char* dst = file.data() + start + (size_t)r * row_bytes;
+            for(int c=0; c<width; c++)
+            {
+                dst[c * bits / 8] |= index[c] << (8 - bits - c * bits % 8);
+            }
+        }
+    }
+    int pixel_bytes = file.size() - start;
+    unsigned char* dib_header = file.data() + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(file.data(),  0, 1, 'B');                 // ID field
+    set_bytes(file.data(),  1, 1, 'M');                 // ID field
+    set_bytes(file.data(),  2, 4, (int)file.size());    // Size of BMP file
+    set_bytes(file.data(), 10, 4, start);               // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);      // DIB header size
+    set_bytes(dib_header,  4, 4, width);                // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height);               // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                    // Number of color planes
+    set_bytes(dib_header, 14, 2, bits);                 // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, compression);          // BI_RGB, BI_RLE8 or BI_RLE4
+    set_bytes(dib_header, 20, 4, pixel_bytes);          // Size of the pixel array
+    set_bytes(dib_header, 24, 4, 2835);                 // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);                 // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, colors);               // Colors in the color table
+
+    // Color table: blue, green, red and a zero byte
+    for(int i=0; i<colors; i++)
+    {
+        set_bytes(file.data(), BMP_HEADER_SIZE + DIB_HEADER_SIZE + 4*i, 4, (int)table->colors[i]);
+    }
+    PROFILE_COUNTS((long)image.stride * height, (long)file.size(), (long)width * height);
+    return true;
+}
+
+/**
+ * Writes an already encoded file in one go
+ * @param filename The file name
+ * @param file     The file's bytes
+ * @return True if successful and false otherwise
+ */
+bool write_encoded_file(string filename, vector<unsigned char>& file)
+{
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        return false;
+    }
+    vector<struct iovec> parts(1);
+    parts[0].iov_base = file.data();
+    parts[0].iov_len = file.size();
+    bool success = write_all(fd, parts);
+    return close(fd) == 0 && success;
+}
+
+// Whether results with few colors are written as paletted BMPs, set by --palette
+bool& palette_output()
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+// Halvings written next to each result, set by --pyramid; 0 for none
+int& pyramid_levels()
+{
+    static int levels = 0;
+    return levels;
+}
+
+/**
+ * Writes a vector of vector of Pixels to a BMP file with the same bytes as
+ * write_image(), packing padded scan lines into a reusable buffer and
+ * issuing one write per block of rows instead of one per pixel
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image_buffered(string filename, const vector<vector<Pixel>>& image)
+{
+    int width_pixels = image[0].size();
+    int height_pixels = image.size();
+    int width_bytes = width_pixels * 3;
+    width_bytes = width_bytes + (4 - width_bytes % 4) % 4;
+
+    fstream stream;
+    stream.open(filename, ios::out | ios::binary);
+    if(!stream.is_open())
+    {
+        return false;
+    }
+
+    unsigned char header[54] = {0};
+    set_bmp_headers(header, width_pixels, height_pixels);
+    stream.write((char*)header, sizeof(header));
+
+    // About 1 MB of scan lines per write; padding bytes stay zero
+    int block_rows = max(1, (1 << 20) / width_bytes);
+    vector<unsigned char> block((size_t)block_rows * width_bytes, 0);
+
+    int h = height_pixels - 1;
+    while(h >= 0)
+    {
+        int rows = min(block_rows, h + 1);
+        for(int k=0; k<rows; k++, h--)
+        {
+            unsigned char* out = block.data() + (size_t)k * width_bytes;
+            for(int w=0; w<width_pixels; w++)
+            {
+                out[0] = image[h][w].blue;
+                out[1] = image[h][w].green;
+                out[2] = image[h][w].red;
+                out += 3;
+            }
+        }
+        stream.write((char*)block.data(), (streamsize)rows * width_bytes);
+    }
+
+    bool success = !stream.fail();
+    stream.close();
+    return success;
+}
+
+
+// One call to TileScheduler::run: its tasks still to finish and the first
+// exception any of them threw
+struct SchedulerBatch
+{
+    const function<void(int)>* job;
+    int remaining;              // Guarded by the scheduler's state_mutex
+    exception_ptr failure;      // Likewise
+    atomic<bool> failed;        // Set with failure; later tasks are skipped
+
+    SchedulerBatch(const function<void(int)>& batch_job, int count) : job(&batch_job), remaining(count), failed(false)
+    {
+    }
+};
+
+// One unit of work handed to the scheduler: job(index) of a batch
+struct SchedulerTask
+{
+    SchedulerBatch* batch;
+    int index;
+};
+
+// Runs batches of independent tasks on a fixed set of threads
+// Each thread has its own queue; a thread that runs dry steals from the back
+// of the other queues. The calling thread works too, so one thread means no
+// extra threads at all. Batches from several calling threads share the
+// queues. Tasks must write disjoint outputs, which keeps the results
+// independent of which thread ran what.
+class TileScheduler
+{
+public:
+    explicit TileScheduler(int threads)
+    {
+        thread_count = max(1, threads);
+        for(int i=0; i<thread_count; i++)
+        {
+            queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue));
+        }
+        stopping = false;
+        generation = 0;
+        for(int i=1; i<thread_count; i++)
+        {
+            workers.push_back(thread(&TileScheduler::worker_loop, this, i));
+        }
+    }
+
+    ~TileScheduler()
+    {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t i=0; i<workers.size(); i++)
+        {
+            workers[i].join();
+        }
+    }
+
+    int threads() const
+    {
+        return thread_count;
+    }
+
+    /**
+     * Runs job(i) for every i in [0, count) and returns when all are done
+     * Calls made from inside a task run inline on the calling thread
+     * instead of waiting. Calls from several threads at once share the
+     * workers, and each caller also runs queued tasks of the others while
+     * it waits. Once a task throws, the batch's tasks not yet started are
+     * skipped, and the first exception is rethrown here after every task
+     * has finished or been skipped.
+     * @param count Number of tasks
+     * @param job   The work for one task index
+     * @return nothing
+     */
+    void run(int count, const function<void(int)>& job)
+    {
+        if(thread_count == 1 || count <= 1 || inside_task())
+        {
+            for(int i=0; i<count; i++)
+            {
+                job(i);
+            }
+            return;
+        }
+
+        // The count is set before any task is queued, so a thread still
+        // draining another batch can take one of these at once
+        SchedulerBatch batch(job, count);
+
+        // Give each thread a contiguous share of the tasks
+        for(int w=0; w<thread_count; w++)
+        {
+            lock_guard<mutex> lock(queues[w]->lock);
+            for(int i=(long)count*w/thread_count; i<(long)count*(w+1)/thread_count; i++)
+            {
+                SchedulerTask task = { &batch, i };
+                queues[w]->tasks.push_back(task);
+            }
+        }
+        {
+            lock_guard<mutex> lock(state_mutex);
+            generation++;
+        }
+        wake.notify_all();
+
+        drain(0);
+
+        // Tasks of this batch may still be running on other threads, which
+        // touch the batch until they count it down
+        exception_ptr failure;
+        {
+            unique_lock<mutex> lock(state_mutex);
+            done.wait(lock, [&]() { return batch.remaining == 0; });
+            failure = batch.failure;
+        }
+        if(failure)
+        {
+            rethrow_exception(failure);
+        }
+    }
+
+private:
+    struct WorkerQueue
+    {
+        mutex lock;
+        deque<SchedulerTask> tasks;
+    };
+
+    static bool& inside_task()
+    {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    // Takes the next task for thread `self`: its own first, then stolen
+    bool next_task(int self, SchedulerTask& task)
+    {
+        for(int k=0; k<thread_count; k++)
+        {
+            WorkerQueue& queue = *queues[(self + k) % thread_count];
+            lock_guard<mutex> lock(queue.lock);
+            if(!queue.tasks.empty())
+            {
+                if(k == 0)
+                {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                else
+                {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Runs tasks until every queue is empty. An exception from a task is
+    // kept in its batch for run() to rethrow, never thrown from here.
+    void drain(int self)
+    {
+        SchedulerTask task;
+        inside_task() = true;
+        while(next_task(self, task))
+        {
+            SchedulerBatch& batch = *task.batch;
+            if(!batch.failed)
+            {
+                try
+                {
+                    (*batch.job)(task.index);
+                }
+                catch(...)
+                {
+                    lock_guard<mutex> lock(state_mutex);
+                    if(!batch.failure)
+                    {
+                        batch.failure = current_exception();
+                    }
+                    batch.failed = true;
+                }
+            }
+            // The batch may be gone once its last task is counted
+            lock_guard<mutex> lock(state_mutex);
+            if(--batch.remaining == 0)
+            {
+                done.notify_all();
+            }
+        }
+        inside_task() = false;
+    }
+
+    void worker_loop(int self)
+    {
+        unsigned int seen = 0;
+        while(true)
+        {
+            {
+                unique_lock<mutex> lock(state_mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if(stopping)
+                {
+                    return;
+                }
+                seen = generation;
+            }
+            drain(self);
+        }
+    }
+
+    int thread_count;
+    vector<thread> workers;
+    vector<unique_ptr<WorkerQueue>> queues;
+    mutex state_mutex;
+    condition_variable wake;
+    condition_variable done;
+    bool stopping;
+    unsigned int generation;
+};
+
+// Thread count used by the filters, set once at startup
+int& configured_threads()
+{
+    static int threads = max(1, (int)thread::hardware_concurrency());
+    return threads;
+}
+
+/**
+ * Sets the number of threads the filters use
+ * Call before the first filter runs
+ * @param threads Number of threads, 1 to run everything on the calling thread
+ * @return nothing
+ */
+void set_thread_count(int threads)
+{
+    configured_threads() = max(1, threads);
+}
+
+// The shared scheduler, created with the configured thread count on first
+// use and recreated if the count has changed since
+TileScheduler& scheduler()
+{
+    static mutex create_mutex;
+    static unique_ptr<TileScheduler> shared;
+    lock_guard<mutex> lock(create_mutex);
+    if(!shared || shared->threads() != configured_threads())
+    {
+        shared.reset();
+        shared.reset(new TileScheduler(configured_threads()));
+    }
+    return *shared;
+}
+
+// Rows per band handed to one task
+const int BAND_ROWS = 16;
+
+/**
+ * Splits rows [0, rows) into bands and runs them on the scheduler
+ * @param rows     Number of rows
+ * @param band_job Called as band_job(first_row, last_row) for each band
+ * @return nothing
+ */
+void parallel_rows(int rows, const function<void(int, int)>& band_job)
+{
+    int bands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+    scheduler().run(bands, [&](int band)
+    {
+        band_job(band * BAND_ROWS, min(rows, (band + 1) * BAND_ROWS));
+    });
+}
+
+
+// A channel scaled by a Q16.16 fixed-point factor, whole + fraction / 65536,
+// with the product rounded down or up. Inverted scales work on 255 - v and
+// invert the result back, as Lighten does. Results wrap to 8 bits.
+struct FixedScale
+{
+    int whole;          // Below 2^15, so it fits a 16 bit lane
+    int fraction;       // 0 to 65535
+    bool round_up;
+    bool invert;
+};
+
+// Scales one channel value
+inline int fixed_scale_value(const FixedScale& scale, int v)
+{
+    int x = scale.invert ? 255 - v : v;
+    int product = x * scale.fraction;
+    int y = x * scale.whole + (product >> 16) + (scale.round_up && (product & 0xFFFF) != 0 ? 1 : 0);
+    return (scale.invert ? 255 - y : y) & 0xFF;
+}
+
+// Vector kernels for the simplest point filters
+// Each kernel handles a whole run of pixels, finishing any leftover pixels
+// with scalar code, and gives the same bytes as the lookup tables below.
+// The best instruction set the CPU supports is picked once at run time.
+struct SimdKernels
+{
+    const char* name;   // "avx2", "sse4.1" or "scalar"
+
+    // Average of the three channels, written to all three
+    void (*gray)(const unsigned char* src, unsigned char* dst, int pixels);
+
+    // 255 in all three channels where red + green + blue >= threshold_sum, else 0
+    void (*threshold)(const unsigned char* src, unsigned char* dst, int pixels, int threshold_sum);
+
+    // Every byte through the same 256 entry table
+    void (*table)(const unsigned char lut[256], const unsigned char* src, unsigned char* dst, int bytes);
+
+    // Each pixel repeated x_scale times side by side
+    void (*replicate)(const unsigned char* src, unsigned char* dst, int pixels, int x_scale);
+
+    // Rounded average of each 2x2 block of two rows, `pixels` blocks wide
+    void (*downsample)(const unsigned char* top, const unsigned char* bottom, unsigned char* dst, int pixels);
+
+    // Every byte scaled by the same factor in 16 bit lanes; null where the
+    // table kernel is faster
+    void (*scale)(const FixedScale& scale, const unsigned char* src, unsigned char* dst, int bytes);
+
+    // Pixels whose channel sum is at least high_sum scaled by `high`, those
+    // below low_sum by `low`, the rest copied; null where tables are faster
+    void (*scale_select)(const FixedScale& high, const FixedScale& low, int high_sum, int low_sum,
+                         const unsigned char* src, unsigned char* dst, int pixels);
+};
+
+void gray_scalar(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for(int i=0; i<pixels; i++)
+    {
+        unsigned char value = (src[0] + src[1] + src[2]) / 3;
+        dst[0] = value;
+        dst[1] = value;
+        dst[2] = value;
+        src += 3;
+        dst += 3;
+    }
+}
+
+void threshold_scalar(const unsigned char* src, unsigned char* dst, int pixels, int threshold_sum)
+{
+    for(int i=0; i<pixels; i++)
+    {
+        unsigned char value = src[0] + src[1] + src[2] >= threshold_sum ? 255 : 0;
+        dst[0] = value;
+        dst[1] = value;
+        dst[2] = value;
+        src += 3;
+        dst += 3;
+    }
+}
+
+void table_scalar(const unsigned char lut[256], const unsigned char* src, unsigned char* dst, int bytes)
+{
+    for(int i=0; i<bytes; i++)
+    {
+        dst[i] = lut[src[i]];
+    }
+}
+
+// Repeats each pixel XScale times; a fixed count unrolls the inner loop
+template<int XScale>
+void replicate_fixed(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    for(int i=0; i<pixels; i++)
+    {
+        for(int k=0; k<XScale; k++)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst += 3;
+        }
+        src += 3;
+    }
+}
+
+void downsample_scalar(const unsigned char* top, const unsigned char* bottom, unsigned char* dst, int pixels)
+{
+    for(int i=0; i<pixels; i++)
+    {
+        dst[0] = (top[0] + top[3] + bottom[0] + bottom[3] + 2) >> 2;
+        dst[1] = (top[1] + top[4] + bottom[1] + bottom[4] + 2) >> 2;
+        dst[2] = (top[2] + top[5] + bottom[2] + bottom[5] + 2) >> 2;
+        top += 6;
+        bottom += 6;
+        dst += 3;
+    }
+}
+
+void replicate_scalar(const unsigned char* src, unsigned char* dst, int pixels, int x_scale)
+{
+    switch(x_scale)
+    {
+        case 1: memcpy(dst, src, 3 * pixels); return;
+        case 2: replicate_fixed<2>(src, dst, pixels); return;
+        case 3: replicate_fixed<3>(src, dst, pixels); return;
+        case 4: replicate_fixed<4>(src, dst, pixels); return;
+    }
+    for(int i=0; i<pixels; i++)
+    {
+        for(int k=0; k<x_scale; k++)
+        {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst += 3;
+        }
+        src += 3;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Shuffle mask that gathers channel `channel` of 16 interleaved pixels from
+// the 16 byte block `part` (0, 1 or 2) of the 48 bytes they occupy
+__attribute__((target("sse4.1")))
+inline __m128i gather_mask(int channel, int part)
+{
+    alignas(16) char mask[16];
+    for(int i=0; i<16; i++)
+    {
+        int index = 3 * i + channel - 16 * part;
+        mask[i] = (index >= 0 && index < 16) ? index : -128;
+    }
+    return _mm_load_si128((const __m128i*)mask);
+}
+
+// Shuffle mask that spreads 16 values to the three channels of the pixels
+// in block `part` of the 48 output bytes
+__attribute__((target("sse4.1")))
+inline __m128i spread_mask(int part)
+{
+    alignas(16) char mask[16];
+    for(int i=0; i<16; i++)
+    {
+        mask[i] = (16 * part + i) / 3;
+    }
+    return _mm_load_si128((const __m128i*)mask);
+}
+
+// Channel sums of 16 interleaved pixels as two vectors of 8 16 bit sums
+struct PixelSums16
+{
+    __m128i low;
+    __m128i high;
+};
+
+struct ChannelMasks
+{
+    __m128i gather[3][3];
+    __m128i spread[3];
+};
+
+__attribute__((target("sse4.1")))
+inline void load_channel_masks(ChannelMasks& masks)
+{
+    for(int channel=0; channel<3; channel++)
+    {
+        for(int part=0; part<3; part++)
+        {
+            masks.gather[channel][part] = gather_mask(channel, part);
+        }
+        masks.spread[channel] = spread_mask(channel);
+    }
+}
+
+// Deinterleaves one channel of 16 pixels
+__attribute__((target("sse4.1")))
+inline __m128i gather_channel(const ChannelMasks& masks, int channel, __m128i a, __m128i b, __m128i c)
+{
+    return _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(a, masks.gather[channel][0]),
+        _mm_shuffle_epi8(b, masks.gather[channel][1])),
+        _mm_shuffle_epi8(c, masks.gather[channel][2]));
+}
+
+// Writes 16 values as the three equal channels of 16 pixels
+__attribute__((target("sse4.1")))
+inline void store_spread(const ChannelMasks& masks, __m128i values, unsigned char* dst)
+{
+    _mm_storeu_si128((__m128i*)(dst +  0), _mm_shuffle_epi8(values, masks.spread[0]));
+    _mm_storeu_si128((__m128i*)(dst + 16), _mm_shuffle_epi8(values, masks.spread[1]));
+    _mm_storeu_si128((__m128i*)(dst + 32), _mm_shuffle_epi8(values, masks.spread[2]));
+}
+
+__attribute__((target("sse4.1")))
+inline PixelSums16 sum_pixels_sse(const ChannelMasks& masks, const unsigned char* src)
+{
+    __m128i a = _mm_loadu_si128((const __m128i*)(src +  0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i blue = gather_channel(masks, 0, a, b, c);
+    __m128i green = gather_channel(masks, 1, a, b, c);
+    __m128i red = gather_channel(masks, 2, a, b, c);
+
+    __m128i zero = _mm_setzero_si128();
+    PixelSums16 sums;
+    sums.low = _mm_add_epi16(_mm_add_epi16(
+        _mm_unpacklo_epi8(blue, zero), _mm_unpacklo_epi8(green, zero)), _mm_unpacklo_epi8(red, zero));
+    sums.high = _mm_add_epi16(_mm_add_epi16(
+        _mm_unpackhi_epi8(blue, zero), _mm_unpackhi_epi8(green, zero)), _mm_unpackhi_epi8(red, zero));
+    return sums;
+}
+
+// x / 3 for 0 <= x < 2^16 is (x * 0xAAAB) >> 17
+__attribute__((target("sse4.1")))
+inline __m128i divide_by_3_sse(__m128i sums)
+{
+    return _mm_srli_epi16(_mm_mulhi_epu16(sums, _mm_set1_epi16((short)0xAAAB)), 1);
+}
+
+__attribute__((target("sse4.1")))
+void gray_sse41(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    ChannelMasks masks;
+    load_channel_masks(masks);
+    int i = 0;
+    for(; i+16<=pixels; i+=16)
+    {
+        PixelSums16 sums = sum_pixels_sse(masks, src + 3 * i);
+        __m128i gray = _mm_packus_epi16(divide_by_3_sse(sums.low), divide_by_3_sse(sums.high));
+        store_spread(masks, gray, dst + 3 * i);
+    }
+    gray_scalar(src + 3 * i, dst + 3 * i, pixels - i);
+}
+
+__attribute__((target("sse4.1")))
+void threshold_sse41(const unsigned char* src, unsigned char* dst, int pixels, int threshold_sum)
+{
+    ChannelMasks masks;
+    load_channel_masks(masks);
+    __m128i below = _mm_set1_epi16((short)(threshold_sum - 1));
+    int i = 0;
+    for(; i+16<=pixels; i+=16)
+    {
+        PixelSums16 sums = sum_pixels_sse(masks, src + 3 * i);
+        // Comparison lanes are all ones (255) or zero; sums fit in a signed 16 bit lane
+        __m128i on = _mm_packs_epi16(_mm_cmpgt_epi16(sums.low, below), _mm_cmpgt_epi16(sums.high, below));
+        store_spread(masks, on, dst + 3 * i);
+    }
+    threshold_scalar(src + 3 * i, dst + 3 * i, pixels - i, threshold_sum);
+}
+
+// Scales channel values held in 16 bit lanes, leaving each result's low byte
+__attribute__((target("sse4.1")))
+inline __m128i fixed_scale_sse(const FixedScale& scale, __m128i x)
+{
+    __m128i low_byte = _mm_set1_epi16(0xFF);
+    if(scale.invert)
+    {
+        x = _mm_xor_si128(x, low_byte);
+    }
+    __m128i fraction = _mm_set1_epi16((short)scale.fraction);
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(x, _mm_set1_epi16((short)scale.whole)), _mm_mulhi_epu16(x, fraction));
+    if(scale.round_up)
+    {
+        // Add 1 unless the low half of x * fraction is zero (all ones there)
+        __m128i exact = _mm_cmpeq_epi16(_mm_mullo_epi16(x, fraction), _mm_setzero_si128());
+        y = _mm_add_epi16(y, _mm_add_epi16(exact, _mm_set1_epi16(1)));
+    }
+    if(scale.invert)
+    {
+        y = _mm_xor_si128(y, low_byte);
+    }
+    return _mm_and_si128(y, low_byte);
+}
+
+// Scales 16 bytes
+__attribute__((target("sse4.1")))
+inline __m128i fixed_scale_bytes_sse(const FixedScale& scale, __m128i bytes)
+{
+    __m128i low = fixed_scale_sse(scale, _mm_cvtepu8_epi16(bytes));
+    __m128i high = fixed_scale_sse(scale, _mm_unpackhi_epi8(bytes, _mm_setzero_si128()));
+    return _mm_packus_epi16(low, high);
+}
+
+__attribute__((target("sse4.1")))
+void scale_sse41(const FixedScale& scale, const unsigned char* src, unsigned char* dst, int bytes)
+{
+    int i = 0;
+    for(; i+16<=bytes; i+=16)
+    {
+        __m128i values = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), fixed_scale_bytes_sse(scale, values));
+    }
+    for(; i<bytes; i++)
+    {
+        dst[i] = fixed_scale_value(scale, src[i]);
+    }
+}
+
+// The scale applies to every channel alike, so the interleaved bytes are
+// scaled as they are and only the per-pixel choice is spread to channels
+__attribute__((target("sse4.1")))
+void scale_select_sse41(const FixedScale& high, const FixedScale& low, int high_sum, int low_sum,
+                        const unsigned char* src, unsigned char* dst, int pixels)
+{
+    ChannelMasks masks;
+    load_channel_masks(masks);
+    __m128i high_below = _mm_set1_epi16((short)(high_sum - 1));
+    __m128i low_limit = _mm_set1_epi16((short)low_sum);
+    int i = 0;
+    for(; i+16<=pixels; i+=16)
+    {
+        PixelSums16 sums = sum_pixels_sse(masks, src + 3 * i);
+        __m128i use_high = _mm_packs_epi16(_mm_cmpgt_epi16(sums.low, high_below), _mm_cmpgt_epi16(sums.high, high_below));
+        __m128i use_low = _mm_packs_epi16(_mm_cmplt_epi16(sums.low, low_limit), _mm_cmplt_epi16(sums.high, low_limit));
+        for(int part=0; part<3; part++)
+        {
+            __m128i values = _mm_loadu_si128((const __m128i*)(src + 3 * i + 16 * part));
+            values = _mm_blendv_epi8(values, fixed_scale_bytes_sse(high, values), _mm_shuffle_epi8(use_high, masks.spread[part]));
+            values = _mm_blendv_epi8(values, fixed_scale_bytes_sse(low, values), _mm_shuffle_epi8(use_low, masks.spread[part]));
+            _mm_storeu_si128((__m128i*)(dst + 3 * i + 16 * part), values);
+        }
+    }
+    for(; i<pixels; i++)
+    {
+        const unsigned char* pixel = src + 3 * i;
+        unsigned char* new_pixel = dst + 3 * i;
+        int sum = pixel[0] + pixel[1] + pixel[2];
+        for(int channel=0; channel<3; channel++)
+        {
+            int v = pixel[channel];
+            new_pixel[channel] = sum >= high_sum ? fixed_scale_value(high, v) : (sum < low_sum ? fixed_scale_value(low, v) : v);
+        }
+    }
+}
+
+// Shuffle mask for block `part` of the 15 * x_scale bytes that 5 pixels
+// become when each is repeated x_scale times
+__attribute__((target("sse4.1")))
+inline __m128i replicate_mask(int x_scale, int part)
+{
+    alignas(16) char mask[16];
+    for(int i=0; i<16; i++)
+    {
+        int j = 16 * part + i;
+        int index = 3 * (j / (3 * x_scale)) + j % 3;
+        mask[i] = index < 15 ? index : -128;
+    }
+    return _mm_load_si128((const __m128i*)mask);
+}
+
+// Widens 5 pixels per 16 byte load with a fixed number of shuffles
+template<int XScale>
+__attribute__((target("sse4.1")))
+void replicate_fixed_sse41(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    const int PARTS = (15 * XScale + 15) / 16;
+    __m128i masks[PARTS];
+    for(int part=0; part<PARTS; part++)
+    {
+        masks[part] = replicate_mask(XScale, part);
+    }
+
+    // The last store of a step runs past its 5 pixels, so keep one spare
+    int i = 0;
+    for(; i+6<=pixels; i+=5)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+        unsigned char* out = dst + 3 * XScale * i;
+        for(int part=0; part<PARTS; part++)
+        {
+            _mm_storeu_si128((__m128i*)(out + 16 * part), _mm_shuffle_epi8(block, masks[part]));
+        }
+    }
+    replicate_fixed<XScale>(src + 3 * i, dst + 3 * XScale * i, pixels - i);
+}
+
+// Factors 2 to 4 widen 5 pixels per 16 byte load with 2 to 4 shuffles
+__attribute__((target("sse4.1")))
+void replicate_sse41(const unsigned char* src, unsigned char* dst, int pixels, int x_scale)
+{
+    switch(x_scale)
+    {
+        case 2: replicate_fixed_sse41<2>(src, dst, pixels); return;
+        case 3: replicate_fixed_sse41<3>(src, dst, pixels); return;
+        case 4: replicate_fixed_sse41<4>(src, dst, pixels); return;
+    }
+    replicate_scalar(src, dst, pixels, x_scale);
+}
+
+// Shuffle mask for output bytes 16 * chunk onwards of 16 pixels made from
+// 32: byte i takes its channel of the left (side 0) or right (side 1)
+// source pixel when that byte is in 16 byte block `block` of the source
+__attribute__((target("sse4.1")))
+inline __m128i downsample_mask(int chunk, int block, int side)
+{
+    alignas(16) char mask[16];
+    for(int i=0; i<16; i++)
+    {
+        int j = 16 * chunk + i;
+        int index = 2 * j - j % 3 + 3 * side - 16 * block;
+        mask[i] = index >= 0 && index < 16 ? index : -128;
+    }
+    return _mm_load_si128((const __m128i*)mask);
+}
+
+// Output chunk k takes source bytes 32k - 2 to 32k + 33, which lie in
+// blocks 2k - 1 to 2k + 2 of the six
+struct DownsampleMasks
+{
+    __m128i pick[3][4][2];
+};
+
+__attribute__((target("sse4.1")))
+inline void load_downsample_masks(DownsampleMasks& masks)
+{
+    for(int chunk=0; chunk<3; chunk++)
+    {
+        for(int block=0; block<4; block++)
+        {
+            for(int side=0; side<2; side++)
+            {
+                masks.pick[chunk][block][side] = downsample_mask(chunk, 2 * chunk - 1 + block, side);
+            }
+        }
+    }
+}
+
+// The left or right pixel's bytes for 16 bytes of output from the 96 bytes
+// of 32 source pixels
+__attribute__((target("sse4.1")))
+inline __m128i gather_pairs(const DownsampleMasks& masks, const __m128i blocks[6], int chunk, int side)
+{
+    __m128i bytes = _mm_setzero_si128();
+    for(int block=0; block<4; block++)
+    {
+        int index = 2 * chunk - 1 + block;
+        if(index >= 0 && index < 6)
+        {
+            bytes = _mm_or_si128(bytes, _mm_shuffle_epi8(blocks[index], masks.pick[chunk][block][side]));
+        }
+    }
+    return bytes;
+}
+
+// Averages 32 pixels of two rows into 16: the left and right pixels of the
+// pairs are gathered into byte vectors and the four summed in 16 bit lanes
+__attribute__((target("sse4.1")))
+void downsample_sse41(const unsigned char* top, const unsigned char* bottom, unsigned char* dst, int pixels)
+{
+    DownsampleMasks masks;
+    load_downsample_masks(masks);
+    __m128i zero = _mm_setzero_si128();
+    __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+    for(; i+16<=pixels; i+=16)
+    {
+        __m128i blocks[2][6];
+        for(int k=0; k<6; k++)
+        {
+            blocks[0][k] = _mm_loadu_si128((const __m128i*)(top + 6 * i + 16 * k));
+            blocks[1][k] = _mm_loadu_si128((const __m128i*)(bottom + 6 * i + 16 * k));
+        }
+        for(int chunk=0; chunk<3; chunk++)
+        {
+            __m128i low = two;
+            __m128i high = two;
+            for(int row=0; row<2; row++)
+            {
+                for(int side=0; side<2; side++)
+                {
+                    __m128i bytes = gather_pairs(masks, blocks[row], chunk, side);
+                    low = _mm_add_epi16(low, _mm_cvtepu8_epi16(bytes));
+                    high = _mm_add_epi16(high, _mm_unpackhi_epi8(bytes, zero));
+                }
+            }
+            __m128i averages = _mm_packus_epi16(_mm_srli_epi16(low, 2), _mm_srli_epi16(high, 2));
+            _mm_storeu_si128((__m128i*)(dst + 3 * i + 16 * chunk), averages);
+        }
+    }
+    downsample_scalar(top + 6 * i, bottom + 6 * i, dst + 3 * i, pixels - i);
+}
+
+// Channel sums of 32 pixels, 16 per 256 bit vector
+__attribute__((target("avx2")))
+inline void sum_pixels_avx2(const ChannelMasks& masks, const unsigned char* src, __m256i& first, __m256i& second)
+{
+    for(int half=0; half<2; half++)
+    {
+        const unsigned char* block = src + 48 * half;
+        __m128i a = _mm_loadu_si128((const __m128i*)(block +  0));
+        __m128i b = _mm_loadu_si128((const __m128i*)(block + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(block + 32));
+        __m256i sums = _mm256_add_epi16(_mm256_add_epi16(
+            _mm256_cvtepu8_epi16(gather_channel(masks, 0, a, b, c)),
+            _mm256_cvtepu8_epi16(gather_channel(masks, 1, a, b, c))),
+            _mm256_cvtepu8_epi16(gather_channel(masks, 2, a, b, c)));
+        (half == 0 ? first : second) = sums;
+    }
+}
+
+// Packs 16 16 bit lanes holding 0..255 into 16 bytes, in order
+__attribute__((target("avx2")))
+inline __m128i pack_lanes_avx2(__m256i values)
+{
+    return _mm_packus_epi16(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+}
+
+__attribute__((target("avx2")))
+void gray_avx2(const unsigned char* src, unsigned char* dst, int pixels)
+{
+    ChannelMasks masks;
+    load_channel_masks(masks);
+    __m256i reciprocal = _mm256_set1_epi16((short)0xAAAB);
+    int i = 0;
+    for(; i+32<=pixels; i+=32)
+    {
+        __m256i first, second;
+        sum_pixels_avx2(masks, src + 3 * i, first, second);
+        first = _mm256_srli_epi16(_mm256_mulhi_epu16(first, reciprocal), 1);
+        second = _mm256_srli_epi16(_mm256_mulhi_epu16(second, reciprocal), 1);
+        store_spread(masks, pack_lanes_avx2(first), dst + 3 * i);
+        store_spread(masks, pack_lanes_avx2(second), dst + 3 * i + 48);
+    }
+    gray_sse41(src + 3 * i, dst + 3 * i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+void threshold_avx2(const unsigned char* src, unsigned char* dst, int pixels, int threshold_sum)
+{
+    ChannelMasks masks;
+    load_channel_masks(masks);
+    __m256i below = _mm256_set1_epi16((short)(threshold_sum - 1));
+    __m256i on = _mm256_set1_epi16(255);
+    int i = 0;
+    for(; i+32<=pixels; i+=32)
+    {
+        __m256i first, second;
+        sum_pixels_avx2(masks, src + 3 * i, first, second);
+        first = _mm256_and_si256(_mm256_cmpgt_epi16(first, below), on);
+        second = _mm256_and_si256(_mm256_cmpgt_epi16(second, below), on);
+        store_spread(masks, pack_lanes_avx2(first), dst + 3 * i);
+        store_spread(masks, pack_lanes_avx2(second), dst + 3 * i + 48);
+    }
+    threshold_sse41(src + 3 * i, dst + 3 * i, pixels - i, threshold_sum);
+}
+
+// The same gathers as downsample_sse41, summed 16 lanes at a time
+__attribute__((target("avx2")))
+void downsample_avx2(const unsigned char* top, const unsigned char* bottom, unsigned char* dst, int pixels)
+{
+    DownsampleMasks masks;
+    load_downsample_masks(masks);
+    __m256i two = _mm256_set1_epi16(2);
+    int i = 0;
+    for(; i+16<=pixels; i+=16)
+    {
+        __m128i blocks[2][6];
+        for(int k=0; k<6; k++)
+        {
+            blocks[0][k] = _mm_loadu_si128((const __m128i*)(top + 6 * i + 16 * k));
+            blocks[1][k] = _mm_loadu_si128((const __m128i*)(bottom + 6 * i + 16 * k));
+        }
+        for(int chunk=0; chunk<3; chunk++)
+        {
+            __m256i sums = two;
+            for(int row=0; row<2; row++)
+            {
+                for(int side=0; side<2; side++)
+                {
+                    sums = _mm256_add_epi16(sums, _mm256_cvtepu8_epi16(gather_pairs(masks, blocks[row], chunk, side)));
+                }
+            }
+            _mm_storeu_si128((__m128i*)(dst + 3 * i + 16 * chunk), pack_lanes_avx2(_mm256_srli_epi16(sums, 2)));
+        }
+    }
+    downsample_scalar(top + 6 * i, bottom + 6 * i, dst + 3 * i, pixels - i);
+}
+
+// 256 entry table lookup of 32 bytes with byte shuffles
+// A shuffle returns row[index & 15], or zero when bit 7 of the index is set.
+// Subtracting 16 * k with signed saturation leaves bit 7 clear only for
+// k <= the high nibble, so XOR-ing rows that hold the difference between
+// consecutive table rows adds up to exactly the wanted row. Bytes from 128
+// up are handled the same way after flipping bit 7.
+// There is no 16 byte version: at that width it loses to plain table reads.
+__attribute__((target("avx2")))
+void table_avx2(const unsigned char lut[256], const unsigned char* src, unsigned char* dst, int bytes)
+{
+    // Byte shuffles stay within each 128 bit lane, so both lanes get the rows
+    __m256i delta[16];
+    for(int k=0; k<16; k++)
+    {
+        __m128i row = _mm_loadu_si128((const __m128i*)(lut + 16 * k));
+        if(k % 8 != 0)
+        {
+            row = _mm_xor_si128(row, _mm_loadu_si128((const __m128i*)(lut + 16 * (k - 1))));
+        }
+        delta[k] = _mm256_broadcastsi128_si256(row);
+    }
+    __m256i flip = _mm256_set1_epi8((char)0x80);
+    int i = 0;
+    for(; i+32<=bytes; i+=32)
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i high = _mm256_xor_si256(low, flip);
+        __m256i result = _mm256_setzero_si256();
+        for(int k=0; k<8; k++)
+        {
+            __m256i step = _mm256_set1_epi8((char)(16 * k));
+            result = _mm256_xor_si256(result, _mm256_shuffle_epi8(delta[k], _mm256_subs_epi8(low, step)));
+            result = _mm256_xor_si256(result, _mm256_shuffle_epi8(delta[k + 8], _mm256_subs_epi8(high, step)));
+        }
+        _mm256_storeu_si256((__m256i*)(dst + i), result);
+    }
+    table_scalar(lut, src + i, dst + i, bytes - i);
+}
+
+// Scales channel values held in 16 bit lanes, leaving each result's low byte
+__attribute__((target("avx2")))
+inline __m256i fixed_scale_avx2(const FixedScale& scale, __m256i x)
+{
+    __m256i low_byte = _mm256_set1_epi16(0xFF);
+    if(scale.invert)
+    {
+        x = _mm256_xor_si256(x, low_byte);
+    }
+    __m256i fraction = _mm256_set1_epi16((short)scale.fraction);
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(x, _mm256_set1_epi16((short)scale.whole)), _mm256_mulhi_epu16(x, fraction));
+    if(scale.round_up)
+    {
+        __m256i exact = _mm256_cmpeq_epi16(_mm256_mullo_epi16(x, fraction), _mm256_setzero_si256());
+        y = _mm256_add_epi16(y, _mm256_add_epi16(exact, _mm256_set1_epi16(1)));
+    }
+    if(scale.invert)
+    {
+        y = _mm256_xor_si256(y, low_byte);
+    }
+    return _mm256_and_si256(y, low_byte);
+}
+
+// Unpacking and packing both work within 128 bit lanes, so bytes keep their order
+__attribute__((target("avx2")))
+void scale_avx2(const FixedScale& scale, const unsigned char* src, unsigned char* dst, int bytes)
+{
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for(; i+32<=bytes; i+=32)
+    {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i low = fixed_scale_avx2(scale, _mm256_unpacklo_epi8(values, zero));
+        __m256i high = fixed_scale_avx2(scale, _mm256_unpackhi_epi8(values, zero));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(low, high));
+    }
+    for(; i<bytes; i++)
+    {
+        dst[i] = fixed_scale_value(scale, src[i]);
+    }
+}
+
+#endif
+
+/**
+ * Picks the best vector kernels this CPU supports, up to a level
+ * @param level "avx2", "sse4.1" or "scalar"
+ * @return the kernels
+ */
+SimdKernels select_simd_kernels(string level)
+{
+    SimdKernels chosen = { "scalar", gray_scalar, threshold_scalar, table_scalar, replicate_scalar, downsample_scalar,
+                           nullptr, nullptr };
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(level == "avx2" && __builtin_cpu_supports("avx2"))
+    {
+        chosen = { "avx2", gray_avx2, threshold_avx2, table_avx2, replicate_sse41, downsample_avx2,
+                   scale_avx2, scale_select_sse41 };
+    }
+    else if(level != "scalar" && __builtin_cpu_supports("sse4.1"))
+    {
+        chosen = { "sse4.1", gray_sse41, threshold_sse41, table_scalar, replicate_sse41, downsample_sse41,
+                   scale_sse41, scale_select_sse41 };
+    }
+#endif
+    return chosen;
+}
+
+// The kernels in use, chosen on first use. Setting the environment variable
+// IMAGE_SIMD to "sse4.1" or "scalar" limits the choice.
+SimdKernels& active_simd_kernels()
+{
+    static SimdKernels kernels = select_simd_kernels(getenv("IMAGE_SIMD") != nullptr ? getenv("IMAGE_SIMD") : "avx2");
+    return kernels;
+}
+
+/**
+ * The vector kernels the filters use
+ * @return the kernels
+ */
+const SimdKernels& simd_kernels()
+{
+    return active_simd_kernels();
+}
+
+/**
+ * Limits the vector kernels the filters use, for comparing paths
+ * Call while no filter is running
+ * @param level "avx2", "sse4.1" or "scalar"; a level the CPU lacks falls back
+ * @return the name of the level chosen
+ */
+string set_simd_level(string level)
+{
+    active_simd_kernels() = select_simd_kernels(level);
+    return active_simd_kernels().name;
+}
+
+
+// How a PointLut computes a pixel
+enum LutKind
+{
+    LUT_CHANNEL,    // Each channel through its own 256 entry table
+    LUT_SUM_VALUE,  // All three channels set to sum_value[red + green + blue]
+    LUT_SUM_SELECT  // sum_select[red + green + blue] picks the channel tables
+};
+
+// sum_select entry meaning "keep only the largest channel, at 255"
+const unsigned char LUT_DOMINANT = 255;
+
+// How a LUT_SUM_SELECT picks its table set: from sum_select, or with the
+// thresholds of a known filter compiled into its loop. The lookup is a
+// single load, so thresholds only pay off where they remove a branch.
+enum SelectRule
+{
+    SELECT_TABLE,
+    SELECT_FIVE_COLORS  // White from FIVE_COLORS_WHITE_SUM up, black up to FIVE_COLORS_BLACK_SUM, else dominant
+};
+
+// Channel sum thresholds of Clarendon (averages 170 and 90) and Five colors
+constexpr int CLARENDON_HIGH_SUM = 3 * 170;
+constexpr int CLARENDON_LOW_SUM = 3 * 90;
+constexpr int FIVE_COLORS_WHITE_SUM = 550;
+constexpr int FIVE_COLORS_BLACK_SUM = 150;
+
+// Vector kernel that computes the same result as a PointLut, if any
+enum VectorOp
+{
+    VECTOR_NONE,
+    VECTOR_TABLE,       // LUT_CHANNEL with one table shared by all channels
+    VECTOR_GRAY,        // LUT_SUM_VALUE holding sum / 3
+    VECTOR_THRESHOLD,   // LUT_SUM_VALUE holding 255 from threshold_sum up, else 0
+    VECTOR_SCALE,       // LUT_CHANNEL whose shared table is scales[0]
+    VECTOR_SCALE_SELECT // LUT_SUM_SELECT of an unchanged set 0, set 1 = scales[1]
+                        // from high_sum up and set 2 = scales[2] below low_sum
+};
+
+// A point filter compiled into lookup tables, so the hot loop does no math
+// Tables are indexed [set][channel][value] with channels in blue, green, red
+// order, matching the bytes of an interleaved Image
+struct PointLut
+{
+    LutKind kind;
+    VectorOp vector_op;
+    SelectRule select_rule;
+    int threshold_sum;
+    int high_sum;
+    int low_sum;
+    FixedScale scales[3];           // Fixed-point forms of the tables, see VectorOp
+    unsigned char tables[3][3][256];
+    unsigned char sum_value[766];
+    unsigned char sum_select[766];
+};
+
+// Starts a PointLut of the given kind with no vector kernel
+PointLut new_point_lut(LutKind kind)
+{
+    PointLut lut;
+    lut.kind = kind;
+    lut.vector_op = VECTOR_NONE;
+    lut.select_rule = SELECT_TABLE;
+    lut.threshold_sum = 0;
+    lut.high_sum = 0;
+    lut.low_sum = 0;
+    return lut;
+}
+
+// Fills table set `set` of every channel with the given function of a value
+template<class Function>
+void fill_lut_tables(PointLut& lut, int set, Function value_for)
+{
+    for(int v=0; v<256; v++)
+    {
+        // Results outside 0..255 wrap, as they do when written to a file
+        unsigned char value = (int)value_for(v);
+        lut.tables[set][0][v] = value;
+        lut.tables[set][1][v] = value;
+        lut.tables[set][2][v] = value;
+    }
+}
+
+/**
+ * Finds a fixed-point scale that gives exactly the bytes of a table built
+ * with double arithmetic, trying the factor's fraction rounded to 1/65536
+ * and a few steps either side, with products rounded down and up
+ * An exact form does not always exist: (int)(v * f) is not quite a linear
+ * function of v, because a double product within an ulp of an integer can
+ * round onto it (0.7 * 10 is 7 but 0.7 * 30 is 20.999999999999996). That
+ * happens for about 0.4% of factors between 0 and 4, always off by one, and
+ * also for Lighten factors above 1, whose negative results are truncated
+ * toward zero. Those filters keep using the table.
+ * @param table          The table to match
+ * @param scaling_factor The factor the table was built from
+ * @param invert         True for tables of 255 - (255 - v) * factor
+ * @param scale          The matching scale
+ * @return True if a scale matches all 256 entries
+ */
+bool find_fixed_scale(const unsigned char table[256], double scaling_factor, bool invert, FixedScale& scale)
+{
+    if(!(scaling_factor >= 0 && scaling_factor < 32767))
+    {
+        return false;
+    }
+    int whole = (int)scaling_factor;
+    long fraction = (long)floor((scaling_factor - whole) * 65536);
+    for(int step=-3; step<=3; step++)
+    {
+        long fixed = (long)whole * 65536 + fraction + step;
+        if(fixed < 0)
+        {
+            continue;
+        }
+        scale.whole = (int)(fixed >> 16);
+        scale.fraction = (int)(fixed & 0xFFFF);
+        scale.invert = invert;
+        for(int round_up=0; round_up<2; round_up++)
+        {
+            scale.round_up = round_up == 1;
+            int v = 0;
+            while(v < 256 && fixed_scale_value(scale, v) == table[v])
+            {
+                v++;
+            }
+            if(v == 256)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Clarendon: lights lighter above an average of 170, darks darker below 90
+PointLut make_lut_2(double scaling_factor)
+{
+    PointLut lut = new_point_lut(LUT_SUM_SELECT);
+    fill_lut_tables(lut, 0, [](int v) { return v; });
+    fill_lut_tables(lut, 1, [=](int v) { return (int)(255 - (255 - v) * scaling_factor); });
+    fill_lut_tables(lut, 2, [=](int v) { return (int)(v * scaling_factor); });
+    for(int sum=0; sum<766; sum++)
+    {
+        int average = sum / 3;
+        lut.sum_select[sum] = average >= 170 ? 1 : (average < 90 ? 2 : 0);
+    }
+
+    // average >= 170 exactly when sum >= 3 * 170, and average < 90 when sum < 3 * 90
+    lut.high_sum = CLARENDON_HIGH_SUM;
+    lut.low_sum = CLARENDON_LOW_SUM;
+    if(find_fixed_scale(lut.tables[1][0], scaling_factor, true, lut.scales[1])
+        && find_fixed_scale(lut.tables[2][0], scaling_factor, false, lut.scales[2]))
+    {
+        lut.vector_op = VECTOR_SCALE_SELECT;
+    }
+    return lut;
+}
+
+// Grayscale: every channel becomes the average
+PointLut make_lut_3()
+{
+    PointLut lut = new_point_lut(LUT_SUM_VALUE);
+    lut.vector_op = VECTOR_GRAY;
+    for(int sum=0; sum<766; sum++)
+    {
+        lut.sum_value[sum] = sum / 3;
+    }
+    return lut;
+}
+
+// High contrast: white at or above half brightness, black below
+PointLut make_lut_7()
+{
+    PointLut lut = new_point_lut(LUT_SUM_VALUE);
+    // sum / 3 >= 255/2 exactly when sum >= 3 * (255/2)
+    lut.vector_op = VECTOR_THRESHOLD;
+    lut.threshold_sum = 3 * (255/2);
+    for(int sum=0; sum<766; sum++)
+    {
+        double gray_value = sum / 3;
+        lut.sum_value[sum] = gray_value >= 255/2 ? 255 : 0;
+    }
+    return lut;
+}
+
+// Lighten by a scaling factor
+PointLut make_lut_8(double scaling_factor)
+{
+    PointLut lut = new_point_lut(LUT_CHANNEL);
+    fill_lut_tables(lut, 0, [=](int v) { return (int)(255 - (255 - v) * scaling_factor); });
+    lut.vector_op = find_fixed_scale(lut.tables[0][0], scaling_factor, true, lut.scales[0]) ? VECTOR_SCALE : VECTOR_TABLE;
+    return lut;
+}
+
+// Darken by a scaling factor
+PointLut make_lut_9(double scaling_factor)
+{
+    PointLut lut = new_point_lut(LUT_CHANNEL);
+    fill_lut_tables(lut, 0, [=](int v) { return (int)(v * scaling_factor); });
+    lut.vector_op = find_fixed_scale(lut.tables[0][0], scaling_factor, false, lut.scales[0]) ? VECTOR_SCALE : VECTOR_TABLE;
+    return lut;
+}
+
+// Five colors: white, black, or the dominant channel at full strength
+PointLut make_lut_10()
+{
+    PointLut lut = new_point_lut(LUT_SUM_SELECT);
+    fill_lut_tables(lut, 0, [](int) { return 0; });
+    fill_lut_tables(lut, 1, [](int) { return 255; });
+    for(int sum=0; sum<766; sum++)
+    {
+        lut.sum_select[sum] = sum >= FIVE_COLORS_WHITE_SUM ? 1 : (sum <= FIVE_COLORS_BLACK_SUM ? 0 : LUT_DOMINANT);
+    }
+    lut.select_rule = SELECT_FIVE_COLORS;
+    return lut;
+}
+
+// Scalar point filter policies: apply() maps one interleaved pixel
+// point_row() is instantiated per policy, so each filter gets its own loop
+// with its thresholds as constants and no per-pixel dispatch
+
+// Each channel through its own table
+struct ChannelTablesPolicy
+{
+    const PointLut& lut;
+
+    inline void apply(const unsigned char* pixel, unsigned char* new_pixel) const
+    {
+        new_pixel[0] = lut.tables[0][0][pixel[0]];
+        new_pixel[1] = lut.tables[0][1][pixel[1]];
+        new_pixel[2] = lut.tables[0][2][pixel[2]];
+    }
+};
+
+// One value from the channel sum, written to all three channels
+struct SumValuePolicy
+{
+    const PointLut& lut;
+
+    inline void apply(const unsigned char* pixel, unsigned char* new_pixel) const
+    {
+        unsigned char value = lut.sum_value[pixel[0] + pixel[1] + pixel[2]];
+        new_pixel[0] = value;
+        new_pixel[1] = value;
+        new_pixel[2] = value;
+    }
+};
+
+// Keeps only the largest channel, at 255; ties go to red, then green
+inline void keep_dominant(int blue, int green, int red, unsigned char* new_pixel)
+{
+    bool red_max = red >= green && red >= blue;
+    bool green_max = !red_max && green >= blue;
+    new_pixel[0] = (!red_max && !green_max) ? 255 : 0;
+    new_pixel[1] = green_max ? 255 : 0;
+    new_pixel[2] = red_max ? 255 : 0;
+}
+
+// Table set picked by sum_select, for any LUT_SUM_SELECT
+struct SumSelectPolicy
+{
+    const PointLut& lut;
+
+    inline void apply(const unsigned char* pixel, unsigned char* new_pixel) const
+    {
+        int blue = pixel[0];
+        int green = pixel[1];
+        int red = pixel[2];
+        int set = lut.sum_select[blue + green + red];
+        if(set == LUT_DOMINANT)
+        {
+            keep_dominant(blue, green, red, new_pixel);
+            return;
+        }
+        new_pixel[0] = lut.tables[set][0][blue];
+        new_pixel[1] = lut.tables[set][1][green];
+        new_pixel[2] = lut.tables[set][2][red];
+    }
+};
+
+// White from WhiteSum up, black up to BlackSum, else the dominant channel
+// Every test is computed and combined with bit operations, without branches
+template<int WhiteSum, int BlackSum>
+struct FiveColorsPolicy
+{
+    inline void apply(const unsigned char* pixel, unsigned char* new_pixel) const
+    {
+        int blue = pixel[0];
+        int green = pixel[1];
+        int red = pixel[2];
+        int sum = blue + green + red;
+        int white = sum >= WhiteSum;
+        int color = (sum > BlackSum) & !white;
+        int red_max = (red >= green) & (red >= blue);
+        int green_max = !red_max & (green >= blue);
+        int blue_max = !red_max & !green_max;
+        new_pixel[0] = -(white | (color & blue_max));
+        new_pixel[1] = -(white | (color & green_max));
+        new_pixel[2] = -(white | (color & red_max));
+    }
+};
+
+// Runs a policy over a row of pixels
+// The policy is copied so the compiler knows pixel stores cannot change it
+template<class Policy>
+inline void point_row(const Policy& policy, const unsigned char* pixel, unsigned char* new_pixel, int width)
+{
+    const Policy local = policy;
+    for(int c=0; c<width; c++)
+    {
+        local.apply(pixel, new_pixel);
+        pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+/**
+ * Runs a compiled point filter over rows [first_row, last_row) of an image
+ * The source and destination may be the same image
+ * @param lut       The compiled filter
+ * @param image     The source image
+ * @param new_image The destination, the same size as the source
+ * @param first_row First row to process
+ * @param last_row  One past the last row to process
+ * @return nothing
+ */
+void apply_point_lut(const PointLut& lut, const Image& image, Image& new_image, int first_row, int last_row)
+{
+    int width = image.width;
+    const SimdKernels& kernels = simd_kernels();
+    for(int r=first_row; r<last_row; r++)
+    {
+        const unsigned char* pixel = image_row(image, r);
+        unsigned char* new_pixel = image_row(new_image, r);
+
+        if(lut.vector_op == VECTOR_SCALE && kernels.scale != nullptr)
+        {
+            kernels.scale(lut.scales[0], pixel, new_pixel, width * 3);
+        }
+        else if(lut.vector_op == VECTOR_TABLE || lut.vector_op == VECTOR_SCALE)
+        {
+            kernels.table(lut.tables[0][0], pixel, new_pixel, width * 3);
+        }
+        else if(lut.vector_op == VECTOR_SCALE_SELECT && kernels.scale_select != nullptr)
+        {
+            kernels.scale_select(lut.scales[1], lut.scales[2], lut.high_sum, lut.low_sum, pixel, new_pixel, width);
+        }
+        else if(lut.vector_op == VECTOR_GRAY)
+        {
+            kernels.gray(pixel, new_pixel, width);
+        }
+        else if(lut.vector_op == VECTOR_THRESHOLD)
+        {
+            kernels.threshold(pixel, new_pixel, width, lut.threshold_sum);
+        }
+        else if(lut.kind == LUT_CHANNEL)
+        {
+            point_row(ChannelTablesPolicy{lut}, pixel, new_pixel, width);
+        }
+        else if(lut.kind == LUT_SUM_VALUE)
+        {
+            point_row(SumValuePolicy{lut}, pixel, new_pixel, width);
+        }
+        else if(lut.select_rule == SELECT_FIVE_COLORS)
+        {
+            point_row(FiveColorsPolicy<FIVE_COLORS_WHITE_SUM, FIVE_COLORS_BLACK_SUM>(), pixel, new_pixel, width);
+        }
+        else
+        {
+            point_row(SumSelectPolicy{lut}, pixel, new_pixel, width);
+        }
+    }
+}
+
+/**
+ * Runs a compiled point filter over a whole image, in parallel row bands
+ * @param lut       The compiled filter
+ * @param image     The source image
+ * @param new_image The destination, reshaped to the source's size; it may be
+ *                  the source itself
+ * @return nothing
+ */
+void apply_point_lut(const PointLut& lut, const Image& image, Image& new_image)
+{
+    if(&new_image != &image)
+    {
+        shape_image(new_image, image.width, image.height);
+    }
+    parallel_rows(image.height, [&](int first_row, int last_row)
+    {
+        apply_point_lut(lut, image, new_image, first_row, last_row);
+    });
+}
+
+/**
+ * Runs a compiled point filter over a whole image, in parallel row bands
+ * @param lut   The compiled filter
+ * @param image The source image
+ * @return the filtered image
+ */
+Image apply_point_lut(const PointLut& lut, const Image& image)
+{
+    Image new_image;
+    apply_point_lut(lut, image, new_image);
+    return new_image;
+}
+
+// Side of the square tiles rotations copy through, in pixels
+// 32 rows of 32 pixels on each side stay in L1 while a tile is transposed
+const int ROTATE_TILE = 32;
+
+// Fills rows [first_row, last_row) of a rotation by Turns quarter turns;
+// the turn count is a template parameter so each loop is fixed at compile time
+template<int Turns>
+void rotate_rows_fixed(const Image& image, Image& new_image, int first_row, int last_row)
+{
+    int height = image.height;
+    int width = image.width;
+
+    if(Turns == 2)
+    {
+        for(int new_r=first_row; new_r<last_row; new_r++)
+        {
+            const unsigned char* pixel = image_row(image, (height-1)-new_r) + 3 * (width-1);
+            unsigned char* new_pixel = image_row(new_image, new_r);
+            for(int c=0; c<width; c++)
+            {
+                new_pixel[0] = pixel[0];
+                new_pixel[1] = pixel[1];
+                new_pixel[2] = pixel[2];
+                pixel -= 3;
+                new_pixel += 3;
+            }
+        }
+        return;
+    }
+
+    for(int tile_r=0; tile_r<height; tile_r+=ROTATE_TILE)
+    {
+        int last_r = min(tile_r + ROTATE_TILE, height);
+        for(int new_r=first_row; new_r<last_row; new_r++)
+        {
+            // Source column c becomes destination row c (90) or width-1-c (270)
+            int c = Turns == 1 ? new_r : (width-1)-new_r;
+            unsigned char* new_row = image_row(new_image, new_r);
+            for(int r=tile_r; r<last_r; r++)
+            {
+                const unsigned char* pixel = image_row(image, r) + 3 * c;
+                unsigned char* new_pixel = new_row + 3 * (Turns == 1 ? (height-1)-r : r);
+                new_pixel[0] = pixel[0];
+                new_pixel[1] = pixel[1];
+                new_pixel[2] = pixel[2];
+            }
+        }
+    }
+}
+
+/**
+ * Fills rows [first_row, last_row) of a rotated image
+ * Destination row r of a quarter turn is a source column, copied through
+ * tiles of ROTATE_TILE source rows so reads and writes stay in cache
+ * @param image     The source image
+ * @param new_image The destination, already sized for the rotation
+ * @param turns     Quarter turns clockwise, 1 to 3
+ * @param first_row First destination row to fill
+ * @param last_row  One past the last destination row to fill
+ * @return nothing
+ */
+void rotate_rows(const Image& image, Image& new_image, int turns, int first_row, int last_row)
+{
+    if(turns == 1)
+    {
+        rotate_rows_fixed<1>(image, new_image, first_row, last_row);
+    }
+    else if(turns == 2)
+    {
+        rotate_rows_fixed<2>(image, new_image, first_row, last_row);
+    }
+    else
+    {
+        rotate_rows_fixed<3>(image, new_image, first_row, last_row);
+    }
+}
+
+/**
+ * Rotates an image by a number of quarter turns clockwise in one pass
+ * Bands of destination rows run in parallel; 180 degrees is a straight
+ * reversal and quarter turns transpose through small tiles
+ * @param image         The interleaved image to rotate
+ * @param quarter_turns Number of 90 degree clockwise turns (any integer)
+ * @param new_image     The destination, reshaped to fit; not the source
+ * @return nothing
+ */
+void rotate_image(const Image& image, int quarter_turns, Image& new_image)
+{
+    int turns = ((quarter_turns % 4) + 4) % 4;
+    if(turns == 0)
+    {
+        new_image = image;
+        return;
+    }
+
+    // Quarter turns swap width and height
+    if(turns == 2)
+    {
+        shape_image(new_image, image.width, image.height);
+    }
+    else
+    {
+        shape_image(new_image, image.height, image.width);
+    }
+    parallel_rows(new_image.height, [&](int first_row, int last_row)
+    {
+        rotate_rows(image, new_image, turns, first_row, last_row);
+    });
+}
+
+/**
+ * Rotates an image by a number of quarter turns clockwise in one pass
+ * @param image         The interleaved image to rotate
+ * @param quarter_turns Number of 90 degree clockwise turns (any integer)
+ * @return the rotated image, the only image allocated
+ */
+Image rotate_image(const Image& image, int quarter_turns)
+{
+    Image new_image;
+    rotate_image(image, quarter_turns, new_image);
+    return new_image;
+}
+
+// Swaps two pixels of an interleaved image
+inline void swap_pixels(unsigned char* a, unsigned char* b)
+{
+    swap(a[0], b[0]);
+    swap(a[1], b[1]);
+    swap(a[2], b[2]);
+}
+
+// Mirrors an image left to right, in place
+void flip_horizontal(Image& image)
+{
+    for(int r=0; r<image.height; r++)
+    {
+        unsigned char* left = image_row(image, r);
+        unsigned char* right = left + 3 * (image.width-1);
+        while(left < right)
+        {
+            swap_pixels(left, right);
+            left += 3;
+            right -= 3;
+        }
+    }
+}
+
+// Mirrors an image top to bottom, in place
+void flip_vertical(Image& image)
+{
+    for(int r=0; r<image.height/2; r++)
+    {
+        swap_ranges(image_row(image, r), image_row(image, r) + image.stride, image_row(image, (image.height-1)-r));
+    }
+}
+
+// Rotates an image by 180 degrees in place: a vertical and a horizontal
+// flip fused into one pass that swaps each pixel with its opposite
+void rotate_180_in_place(Image& image)
+{
+    int height = image.height;
+    int width = image.width;
+    // Each band swaps its rows with their mirrors, which no other band touches
+    parallel_rows((height+1)/2, [&](int first_row, int last_row)
+    {
+        for(int r=first_row; r<last_row; r++)
+        {
+            unsigned char* front = image_row(image, r);
+            unsigned char* back = image_row(image, (height-1)-r) + 3 * (width-1);
+            // The middle row of an odd height image only reverses its own half
+            int count = r == (height-1)-r ? width/2 : width;
+            for(int c=0; c<count; c++)
+            {
+                swap_pixels(front, back);
+                front += 3;
+                back -= 3;
+            }
+        }
+    });
+}
+
+// Vignette falloff for one image size
+// The factor only depends on the distance from the center pixel, so one
+// quadrant indexed by the absolute row and column offsets covers the image.
+// A quadrant too large to keep leaves factors empty, and each row's
+// factors are computed as it is darkened.
+struct VignetteMap
+{
+    int width;
+    int height;
+    int quadrant_width;         // width/2 + 1 column offsets
+    vector<double> factors;     // [|row offset|][|column offset|]
+};
+
+// Memory for the vignette maps of recently used image sizes, about one 8K
+// map; the factors stay double so results match the per-pixel vignette
+const size_t VIGNETTE_CACHE_BYTES = 128 << 20;
+
+// Computes the vignette factors of column offsets [0, count) for row offset
+// dy from the center, with the same expressions as the per-pixel vignette
+void vignette_factors(int height, int dy, int count, double factors[])
+{
+    for(int dx=0; dx<count; dx++)
+    {
+        double distance = sqrt(pow(dx,2) + pow(dy,2));
+        factors[dx] = (height - distance) / height;
+    }
+}
+
+// Darkens one row of pixels by the factors of its row offset
+inline void vignette_row(const double factors[], int width, const unsigned char* pixel, unsigned char* new_pixel)
+{
+    int center_c = width/2;
+    for(int c=0; c<width; c++)
+    {
+        double scaling_factor = factors[abs(c - center_c)];
+        int new_red = pixel[2] * scaling_factor;
+        int new_green = pixel[1] * scaling_factor;
+        int new_blue = pixel[0] * scaling_factor;
+        
+        new_pixel[2] = new_red;
+        new_pixel[1] = new_green;
+        new_pixel[0] = new_blue;
+        pixel += 3;
+        new_pixel += 3;
+    }
+}
+
+// Bytes of the vignette factors of one image size
+size_t vignette_map_bytes(int width, int height)
+{
+    return (size_t)(width/2 + 1) * (height/2 + 1) * sizeof(double);
+}
+
+/**
+ * Computes the vignette factors for one image size
+ * Uses the same expressions as the per-pixel vignette so results match.
+ * Factors over VIGNETTE_CACHE_BYTES are left to be computed row by row.
+ * @param width  Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return the new map
+ */
+shared_ptr<const VignetteMap> make_vignette_map(int width, int height)
+{
+    shared_ptr<VignetteMap> map = make_shared<VignetteMap>();
+    map->width = width;
+    map->height = height;
+    map->quadrant_width = width/2 + 1;
+    int quadrant_height = height/2 + 1;
+    if(vignette_map_bytes(width, height) > VIGNETTE_CACHE_BYTES)
+    {
+        return map;
+    }
+    map->factors.resize((size_t)map->quadrant_width * quadrant_height);
+
+    for(int dy=0; dy<quadrant_height; dy++)
+    {
+        vignette_factors(height, dy, map->quadrant_width, map->factors.data() + (size_t)dy * map->quadrant_width);
+    }
+    return map;
+}
+
+/**
+ * Gets the vignette map for an image size, computing it only the first time
+ * the size is seen; the most recently used sizes are kept, up to
+ * VIGNETTE_CACHE_BYTES of factors
+ * @param width  Width of the image in pixels
+ * @param height Height of the image in pixels
+ * @return the shared map
+ */
+shared_ptr<const VignetteMap> vignette_map(int width, int height)
+{
+    static mutex cache_mutex;
+    static vector<shared_ptr<const VignetteMap>> cache;     // Most recent last
+    static size_t cache_bytes = 0;
+
+    lock_guard<mutex> lock(cache_mutex);
+    for(size_t i=0; i<cache.size(); i++)
+    {
+        if(cache[i]->width == width && cache[i]->height == height)
+        {
+            shared_ptr<const VignetteMap> map = cache[i];
+            cache.erase(cache.begin() + i);
+            cache.push_back(map);
+            return map;
+        }
+    }
+
+    shared_ptr<const VignetteMap> map = make_vignette_map(width, height);
+    size_t bytes = map->factors.size() * sizeof(double);
+    while(!cache.empty() && cache_bytes + bytes > VIGNETTE_CACHE_BYTES)
+    {
+        cache_bytes -= cache.front()->factors.size() * sizeof(double);
+        cache.erase(cache.begin());
+    }
+    cache.push_back(map);
+    cache_bytes += bytes;
+    return map;
+}
+
+/**
+ * Darkens rows [first_row, last_row) by the vignette factors, one multiply
+ * per channel; the source and destination may be the same image
+ * @param map       The vignette map for this image size
+ * @param image     The source image
+ * @param new_image The destination, the same size as the source
+ * @param first_row First row to process
+ * @param last_row  One past the last row to process
+ * @return nothing
+ */
+void apply_vignette(const VignetteMap& map, const Image& image, Image& new_image, int first_row, int last_row)
+{
+    vector<double> row_factors(map.factors.empty() ? map.quadrant_width : 0);
+    for(int r=first_row; r<last_row; r++)
+    {
+        int dy = abs(r - map.height/2);
+        const double* factors = row_factors.data();
+        if(map.factors.empty())
+        {
+            vignette_factors(map.height, dy, map.quadrant_width, row_factors.data());
+        }
+        else
+        {
+            factors = map.factors.data() + (size_t)dy * map.quadrant_width;
+        }
+        vignette_row(factors, map.width, image_row(image, r), image_row(new_image, r));
+    }
+}
+
+/**
+ * Darkens rows [first_row, last_row) of a band in place by the vignette of
+ * the whole image, computing each row's factors instead of keeping a map
+ * @param width     Width of the whole image in pixels
+ * @param height    Height of the whole image in pixels
+ * @param band      Consecutive rows of the image, starting at top_row
+ * @param top_row   Image row of the first band row
+ * @param first_row First band row to process
+ * @param last_row  One past the last band row to process
+ * @return nothing
+ */
+void apply_vignette_band(int width, int height, Image& band, int top_row, int first_row, int last_row)
+{
+    vector<double> factors(width/2 + 1);
+    for(int r=first_row; r<last_row; r++)
+    {
+        vignette_factors(height, abs(top_row + r - height/2), factors.size(), factors.data());
+        vignette_row(factors.data(), width, image_row(band, r), image_row(band, r));
+    }
+}
+
+// The packed filters write into a destination image the caller owns, which
+// is reshaped to the result's size; a destination of the same size as last
+// time keeps its buffer, so a loop over frames allocates nothing. The
+// destination may be the source image for the point filters (1, 2, 3, 7, 8,
+// 9 and 10) and for rotations, but not for enlargement.
+
 //Adds vignette effect to image (dark corners)
+void process_1(const Image& image, Image& new_image)
+{
+    PROFILE_FILTER("process_1", image, 1);
+    if(&new_image != &image)
+    {
+        shape_image(new_image, image.width, image.height);
+    }
+    shared_ptr<const VignetteMap> map = vignette_map(image.width, image.height);
+    parallel_rows(image.height, [&](int first_row, int last_row)
+    {
+        apply_vignette(*map, image, new_image, first_row, last_row);
+    });
+}
+
+
+//Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
+void process_2(const Image& image, Image& new_image, double scaling_factor)
+{
+    PROFILE_FILTER("process_2", image, 1);
+    apply_point_lut(make_lut_2(scaling_factor), image, new_image);
+}
+
+
+// Grayscale image
+void process_3(const Image& image, Image& new_image)
+{
+    PROFILE_FILTER("process_3", image, 1);
+    apply_point_lut(make_lut_3(), image, new_image);
+}
+
+
+// Grayscale image read directly from a mapped file
+Image process_3(const MappedImage& image)
+{
+    PROFILE_FILTER("process_3 mapped", image, 1);
+    int height = image.height;
+    int width = image.width;
+    Image new_image = make_uninitialized_image(width, height);
+    
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* new_pixel = image_row(new_image, r);
+        for(int c=0; c<width; c++)
+        {
+            const unsigned char* pixel = pixel_at(image, r, c);
+            int gray_value = (pixel[2] + pixel[1] + pixel[0]) / 3;
+            
+            new_pixel[2] = gray_value;
+            new_pixel[1] = gray_value;
+            new_pixel[0] = gray_value;
+            new_pixel += 3;
+        }
+    }
+    return new_image;
+}
+
+
+// Rotates image by 90 degrees clockwise (not counter-clockwise)
+void process_4(const Image& image, Image& new_image)
+{
+    PROFILE_FILTER("process_4", image, 1);
+    if(&new_image == &image)
+    {
+        // A quarter turn changes the shape, so it needs a second buffer
+        Image rotated;
+        rotate_image(image, 1, rotated);
+        new_image = move(rotated);
+        return;
+    }
+    rotate_image(image, 1, new_image);
+}
+    
+
+// Rotates image by a specified number of multiples of 90 degrees clockwise
+void process_5(const Image& image, Image& new_image, int number)
+{
+    PROFILE_FILTER("process_5", image, 1);
+    int angle = number * 90;
+    
+    if(angle%90 != 0)
+    {
+        cout << "angle must be a multiple of 90 degrees.";
+        new_image = image;
+    }
+    else if(angle%360 == 0)
+    {
+        new_image = image;
+    }
+    else if(angle%360 == 90)
+    {
+        process_4(image, new_image);
+    }
+    else if(angle%360 == 180 && &new_image == &image)
+    {
+        rotate_180_in_place(new_image);
+    }
+    else if(angle%360 == 180)
+    {
+        rotate_image(image, 2, new_image);
+    }
+    else if(&new_image == &image)
+    {
+        Image rotated;
+        rotate_image(image, 3, rotated);
+        new_image = move(rotated);
+    }
+    else
+    {
+        rotate_image(image, 3, new_image);
+    }
+}
+
+
+// Fills rows [first_row, last_row) of an enlarged image
+// Each source row is widened once and the rows repeating it are copies of
+// the row above, so no pixel index is ever divided
+void enlarge_rows(const Image& image, Image& new_image, int x_scale, int y_scale, int first_row, int last_row)
+{
+    const SimdKernels& kernels = simd_kernels();
+    for(int r=first_row; r<last_row; r++)
+    {
+        unsigned char* new_row = image_row(new_image, r);
+        if(r == first_row || r % y_scale == 0)
+        {
+            kernels.replicate(image_row(image, r/y_scale), new_row, image.width, x_scale);
+        }
+        else
+        {
+            memcpy(new_row, image_row(new_image, r-1), new_image.stride);
+        }
+    }
+}
+
+
+// Enlarges the image in the x and y direction
+void process_6(const Image& image, Image& new_image, int x_scale, int y_scale)
+{
+    PROFILE_FILTER("process_6", image, x_scale * y_scale);
+    shape_image(new_image, image.width*x_scale, image.height*y_scale);
+    parallel_rows(new_image.height, [&](int first_row, int last_row)
+    {
+        enlarge_rows(image, new_image, x_scale, y_scale, first_row, last_row);
+    });
+}
+
+
+// Convert image to high contrast (black and white only)
+void process_7(const Image& image, Image& new_image)
+{
+    PROFILE_FILTER("process_7", image, 1);
+    apply_point_lut(make_lut_7(), image, new_image);
+}
+
+
+// Convert image read directly from a mapped file to high contrast
+Image process_7(const MappedImage& image)
+{
+    PROFILE_FILTER("process_7 mapped", image, 1);
+    int height = image.height;
+    int width = image.width;
+    Image new_image = make_uninitialized_image(width, height);
+    
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* new_pixel = image_row(new_image, r);
+        for(int c=0; c<width; c++)
+        {
+            const unsigned char* pixel = pixel_at(image, r, c);
+            double gray_value = (pixel[2] + pixel[1] + pixel[0]) / 3;
+            int value = gray_value >= 255/2 ? 255 : 0;
+            
+            new_pixel[2] = value;
+            new_pixel[1] = value;
+            new_pixel[0] = value;
+            new_pixel += 3;
+        }
+    }
+    return new_image;
+}
+
+    
+// Lightens image by a scaling factor
+void process_8(const Image& image, Image& new_image, double scaling_factor)
+{
+    PROFILE_FILTER("process_8", image, 1);
+    apply_point_lut(make_lut_8(scaling_factor), image, new_image);
+}
+    
+    
+// Darkens image by a scaling factor
+void process_9(const Image& image, Image& new_image, double scaling_factor)
+{
+    PROFILE_FILTER("process_9", image, 1);
+    apply_point_lut(make_lut_9(scaling_factor), image, new_image);
+}
+
+
+// Darkens image read directly from a mapped file by a scaling factor
+Image process_9(const MappedImage& image, double scaling_factor)
+{
+    PROFILE_FILTER("process_9 mapped", image, 1);
+    int height = image.height;
+    int width = image.width;
+    Image new_image = make_uninitialized_image(width, height);
+    
+    for(int r=0; r<height; r++)
+    {
+        unsigned char* new_pixel = image_row(new_image, r);
+        for(int c=0; c<width; c++)
+        {
+            const unsigned char* pixel = pixel_at(image, r, c);
+            int new_red = pixel[2] * scaling_factor;
+            int new_green = pixel[1] * scaling_factor;
+            int new_blue = pixel[0] * scaling_factor;
+            
+            new_pixel[2] = new_red;
+            new_pixel[1] = new_green;
+            new_pixel[0] = new_blue;
+            new_pixel += 3;
+        }
+    }
+    return new_image;
+}
+    
+    
+// Converts image to only black, white, red, blue, and green
+void process_10(const Image& image, Image& new_image)
+{
+    PROFILE_FILTER("process_10", image, 1);
+    apply_point_lut(make_lut_10(), image, new_image);
+}
+
+
+// The packed filters, returning a new image
+Image process_1(const Image& image)
+{
+    Image new_image;
+    process_1(image, new_image);
+    return new_image;
+}
+
+Image process_2(const Image& image, double scaling_factor)
+{
+    Image new_image;
+    process_2(image, new_image, scaling_factor);
+    return new_image;
+}
+
+Image process_3(const Image& image)
+{
+    Image new_image;
+    process_3(image, new_image);
+    return new_image;
+}
+
+Image process_4(const Image& image)
+{
+    Image new_image;
+    process_4(image, new_image);
+    return new_image;
+}
+
+Image process_5(const Image& image, int number)
+{
+    Image new_image;
+    process_5(image, new_image, number);
+    return new_image;
+}
+
+Image process_6(const Image& image, int x_scale, int y_scale)
+{
+    Image new_image;
+    process_6(image, new_image, x_scale, y_scale);
+    return new_image;
+}
+
+Image process_7(const Image& image)
+{
+    Image new_image;
+    process_7(image, new_image);
+    return new_image;
+}
+
+Image process_8(const Image& image, double scaling_factor)
+{
+    Image new_image;
+    process_8(image, new_image, scaling_factor);
+    return new_image;
+}
+
+Image process_9(const Image& image, double scaling_factor)
+{
+    Image new_image;
+    process_9(image, new_image, scaling_factor);
+    return new_image;
+}
+
+Image process_10(const Image& image)
+{
+    Image new_image;
+    process_10(image, new_image);
+    return new_image;
+}
+
+
+// The packed filters on an image the caller no longer needs, such as
+// process_2(move(image), 0.5): the point filters and half turns reuse its
+// buffer, so they never hold a second image
+Image process_1(Image&& image)
+{
+    process_1(image, image);
+    return move(image);
+}
+
+Image process_2(Image&& image, double scaling_factor)
+{
+    process_2(image, image, scaling_factor);
+    return move(image);
+}
+
+Image process_3(Image&& image)
+{
+    process_3(image, image);
+    return move(image);
+}
+
+Image process_5(Image&& image, int number)
+{
+    process_5(image, image, number);
+    return move(image);
+}
+
+Image process_7(Image&& image)
+{
+    process_7(image, image);
+    return move(image);
+}
+
+Image process_8(Image&& image, double scaling_factor)
+{
+    process_8(image, image, scaling_factor);
+    return move(image);
+}
+
+Image process_9(Image&& image, double scaling_factor)
+{
+    process_9(image, image, scaling_factor);
+    return move(image);
+}
+
+Image process_10(Image&& image)
+{
+    process_10(image, image);
+    return move(image);
+}
+
+
+// The original vector of Pixels interface, kept as thin adapters over the
+// packed image filters above
 vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    return to_pixels(process_1(to_image(image)));
+}
+
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_2(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_3(to_image(image)));
+}
+
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_4(to_image(image)));
+}
+
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+{
+    return to_pixels(process_5(to_image(image), number));
+}
+
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{
+    return to_pixels(process_6(to_image(image), x_scale, y_scale));
+}
+
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_7(to_image(image)));
+}
+
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_8(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_9(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_10(to_image(image)));
+}
+
+// One step of a filter recipe: a menu process number and its parameters
+struct FilterStage
+{
+    int process;            // 1 to 10, as in the menu
+    double scaling_factor;  // Processes 2, 8 and 9
+    int number;             // Process 5: number of 90 degree rotations
+    int x_scale;            // Process 6
+    int y_scale;            // Process 6
+};
+
+// Builds a recipe stage; parameters a process does not use keep their defaults
+FilterStage make_stage(int process, double scaling_factor = 1.0, int number = 0, int x_scale = 1, int y_scale = 1)
+{
+    FilterStage stage = { process, scaling_factor, number, x_scale, y_scale };
+    return stage;
+}
+
+/**
+ * Parses a filter recipe such as "9:0.5,2:0.3,1"
+ * Stages are separated by commas and run left to right. Processes 2, 8 and 9
+ * take a scaling factor, 5 a number of rotations and 6 a scale as "XxY".
+ * @param text   The recipe text
+ * @param stages The parsed stages
+ * @return True if the whole recipe is valid
+ */
+bool parse_recipe(string text, vector<FilterStage>& stages)
+{
+    stages.clear();
+    if(text.empty() || text[text.size() - 1] == ',')
+    {
+        return false;
+    }
+    stringstream recipe(text);
+    string item;
+    while(getline(recipe, item, ','))
+    {
+        FilterStage stage = make_stage(0);
+        size_t colon = item.find(':');
+        string number = item.substr(0, colon);
+        string parameter = colon == string::npos ? "" : item.substr(colon + 1);
+        char* end = nullptr;
+        stage.process = strtol(number.c_str(), &end, 10);
+        if(number.empty() || *end != '\0' || stage.process < 1 || stage.process > 10)
+        {
+            return false;
+        }
+
+        bool needs_parameter = stage.process == 2 || stage.process == 5 || stage.process == 6
+            || stage.process == 8 || stage.process == 9;
+        if(needs_parameter == parameter.empty())
+        {
+            return false;
+        }
+        if(stage.process == 5)
+        {
+            stage.number = strtol(parameter.c_str(), &end, 10);
+        }
+        else if(stage.process == 6)
+        {
+            long x_scale = strtol(parameter.c_str(), &end, 10);
+            if(*end != 'x')
+            {
+                return false;
+            }
+            long y_scale = strtol(end + 1, &end, 10);
+            if(x_scale < 1 || y_scale < 1 || x_scale > INT_MAX || y_scale > INT_MAX)
+            {
+                return false;
+            }
+            stage.x_scale = x_scale;
+            stage.y_scale = y_scale;
+        }
+        else if(needs_parameter)
+        {
+            stage.scaling_factor = strtod(parameter.c_str(), &end);
+        }
+        if(needs_parameter && *end != '\0')
+        {
+            return false;
+        }
+        stages.push_back(stage);
+    }
+    return !stages.empty();
+}
+
+/**
+ * Writes stages in the form parse_recipe() reads, with scaling factors at
+ * full precision, so equal recipes give equal text
+ * @param stages The recipe
+ * @return the recipe text
+ */
+string format_recipe(const vector<FilterStage>& stages)
+{
+    ostringstream text;
+    text << setprecision(17);
+    for(size_t i=0; i<stages.size(); i++)
+    {
+        const FilterStage& stage = stages[i];
+        text << (i > 0 ? "," : "") << stage.process;
+        if(stage.process == 2 || stage.process == 8 || stage.process == 9)
+        {
+            text << ":" << stage.scaling_factor;
+        }
+        else if(stage.process == 5)
+        {
+            text << ":" << stage.number;
+        }
+        else if(stage.process == 6)
+        {
+            text << ":" << stage.x_scale << "x" << stage.y_scale;
+        }
+    }
+    return text.str();
+}
+
+// Number of clockwise quarter turns process_5 makes for a number of rotations
+int rotation_turns(int number)
+{
+    int angle = (number * 90) % 360;
+    return angle == 0 ? 0 : (angle == 90 ? 1 : (angle == 180 ? 2 : 3));
+}
+
+// A point filter inside a fused pipeline segment
+struct PipelineOp
+{
+    bool vignette;      // Position dependent, so it cannot be folded into a table
+    PointLut lut;
+};
+
+// Stages that share one output image: an optional rotation or enlargement
+// followed by point filters applied in place, band by band
+struct PipelineSegment
+{
+    int geometry;       // 0 for none, else 4, 5 or 6
+    FilterStage geometry_stage;
+    vector<PipelineOp> ops;
+};
+
+// Compiles a point filter stage into a table
+PointLut stage_lut(const FilterStage& stage)
+{
+    switch(stage.process)
+    {
+        case 2: return make_lut_2(stage.scaling_factor);
+        case 3: return make_lut_3();
+        case 7: return make_lut_7();
+        case 8: return make_lut_8(stage.scaling_factor);
+        case 9: return make_lut_9(stage.scaling_factor);
+        default: return make_lut_10();
+    }
+}
+
+// True when all three channels of a table set hold the same table
+bool same_channel_tables(const PointLut& lut, int set)
+{
+    return memcmp(lut.tables[set][0], lut.tables[set][1], 256) == 0
+        && memcmp(lut.tables[set][0], lut.tables[set][2], 256) == 0;
+}
+
+/**
+ * Folds two consecutive point filters into one table when possible: a
+ * channel table after any filter that does not keep only the dominant color
+ * @param first    The filter that runs first
+ * @param second   The filter that runs second
+ * @param combined The single filter with the same effect
+ * @return True if the filters could be combined
+ */
+bool compose_point_luts(const PointLut& first, const PointLut& second, PointLut& combined)
+{
+    if(second.kind != LUT_CHANNEL)
+    {
+        return false;
+    }
+
+    if(first.kind == LUT_SUM_VALUE)
+    {
+        // All three channels come out equal, so they need a shared table
+        if(!same_channel_tables(second, 0))
+        {
+            return false;
+        }
+        combined = new_point_lut(LUT_SUM_VALUE);
+        for(int sum=0; sum<766; sum++)
+        {
+            combined.sum_value[sum] = second.tables[0][0][first.sum_value[sum]];
+        }
+        return true;
+    }
+
+    if(first.kind == LUT_SUM_SELECT)
+    {
+        for(int sum=0; sum<766; sum++)
+        {
+            if(first.sum_select[sum] == LUT_DOMINANT)
+            {
+                return false;
+            }
+        }
+    }
+
+    combined = first;
+    combined.vector_op = VECTOR_NONE;
+    int sets = first.kind == LUT_CHANNEL ? 1 : 3;
+    for(int set=0; set<sets; set++)
+    {
+        for(int channel=0; channel<3; channel++)
+        {
+            for(int v=0; v<256; v++)
+            {
+                combined.tables[set][channel][v] = second.tables[0][channel][first.tables[set][channel][v]];
+            }
+        }
+    }
+    if(combined.kind == LUT_CHANNEL && same_channel_tables(combined, 0))
+    {
+        combined.vector_op = VECTOR_TABLE;
+    }
+    return true;
+}
+
+/**
+ * Groups recipe stages into segments and folds adjacent table filters
+ * Rotations by a multiple of 360 degrees and 1x1 enlargements are dropped
+ * @param stages The recipe
+ * @return the segments to run in order
+ */
+vector<PipelineSegment> plan_pipeline(const vector<FilterStage>& stages)
+{
+    vector<PipelineSegment> segments;
+    for(size_t i=0; i<stages.size(); i++)
+    {
+        const FilterStage& stage = stages[i];
+        bool geometry = stage.process == 4 || stage.process == 5 || stage.process == 6;
+        if(geometry)
+        {
+            bool no_op = (stage.process == 5 && rotation_turns(stage.number) == 0)
+                || (stage.process == 6 && stage.x_scale == 1 && stage.y_scale == 1);
+            if(!no_op)
+            {
+                PipelineSegment segment = PipelineSegment();
+                segment.geometry = stage.process;
+                segment.geometry_stage = stage;
+                segments.push_back(segment);
+            }
+            continue;
+        }
+
+        if(segments.empty())
+        {
+            PipelineSegment segment = PipelineSegment();
+            segment.geometry = 0;
+            segments.push_back(segment);
+        }
+        vector<PipelineOp>& ops = segments.back().ops;
+
+        PipelineOp op;
+        op.vignette = stage.process == 1;
+        if(!op.vignette)
+        {
+            op.lut = stage_lut(stage);
+            PointLut combined;
+            if(!ops.empty() && !ops.back().vignette && compose_point_luts(ops.back().lut, op.lut, combined))
+            {
+                ops.back().lut = combined;
+                continue;
+            }
+        }
+        ops.push_back(op);
+    }
+    return segments;
+}
+
+/**
+ * Checks that every image a recipe makes fits a BMP file, before any of
+ * them is allocated, so that enlargements from a client cannot overflow
+ * @param segments The recipe, planned by plan_pipeline()
+ * @param width    Width of the source image in pixels
+ * @param height   Height of the source image in pixels
+ * @return False if an enlargement makes an image over 4 GB
+ */
+bool pipeline_fits(const vector<PipelineSegment>& segments, int width, int height)
+{
+    // Each size stays under 2^32 bytes, so the next product fits a long
+    long out_width = width;
+    long out_height = height;
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        if(segments[s].geometry == 6)
+        {
+            out_width *= segments[s].geometry_stage.x_scale;
+            out_height *= segments[s].geometry_stage.y_scale;
+            if(54 + (out_width * 3 + 3) / 4 * 4 * out_height > (long)UINT_MAX)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Runs one pipeline segment
+ * The output rows are produced band by band: the rotation or enlargement
+ * (or the first point filter) writes a band, then the remaining point
+ * filters update that band in place while it is still in cache.
+ * @param source  The segment's input
+ * @param segment The segment
+ * @param output  The destination, reshaped to fit; it may be the source
+ *                unless the segment rotates by a quarter turn or enlarges
+ * @return nothing
+ */
+void run_segment(const Image& source, const PipelineSegment& segment, Image& output)
+{
+    const FilterStage& stage = segment.geometry_stage;
+    int turns = segment.geometry == 4 ? 1 : (segment.geometry == 5 ? rotation_turns(stage.number) : 0);
+    bool in_place = &output == &source;
+
+    int width = source.width;
+    int height = source.height;
+    if(segment.geometry == 6)
+    {
+        width = width * stage.x_scale;
+        height = height * stage.y_scale;
+    }
+    else if(turns % 2 == 1)
+    {
+        swap(width, height);
+    }
+    if(!in_place)
+    {
+        shape_image(output, width, height);
+    }
+    else if(turns == 2)
+    {
+        rotate_180_in_place(output);
+    }
+
+    vector<shared_ptr<const VignetteMap>> maps(segment.ops.size());
+    for(size_t k=0; k<segment.ops.size(); k++)
+    {
+        if(segment.ops[k].vignette)
+        {
+            maps[k] = vignette_map(width, height);
+        }
+    }
+
+    parallel_rows(height, [&](int first_row, int last_row)
+    {
+        // In place, a half turn has already been done
+        const Image* band_source = &source;
+        if(!in_place && segment.geometry == 6)
+        {
+            enlarge_rows(source, output, stage.x_scale, stage.y_scale, first_row, last_row);
+            band_source = &output;
+        }
+        else if(!in_place && segment.geometry != 0)
+        {
+            rotate_rows(source, output, turns, first_row, last_row);
+            band_source = &output;
+        }
+
+        for(size_t k=0; k<segment.ops.size(); k++)
+        {
+            if(segment.ops[k].vignette)
+            {
+                apply_vignette(*maps[k], *band_source, output, first_row, last_row);
+            }
+            else
+            {
+                apply_point_lut(segment.ops[k].lut, *band_source, output, first_row, last_row);
+            }
+            band_source = &output;
+        }
+    });
+}
+
+/**
+ * Runs a filter recipe with as few full-size images as possible
+ * Each segment writes one output image, see run_segment(). A recipe of only
+ * point filters writes only the result; longer recipes alternate between
+ * the result and one scratch image.
+ * @param image    The source image
+ * @param segments The recipe, planned by plan_pipeline()
+ * @param result   The destination, reshaped to fit; not the source
+ * @return nothing
+ */
+void run_pipeline(const Image& image, const vector<PipelineSegment>& segments, Image& result)
+{
+    if(segments.empty())
+    {
+        result = image;
+        return;
+    }
+
+    const Image* source = &image;
+    Image scratch;
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        // The last segment writes the result, so a segment never writes the
+        // image it reads
+        Image& output = (segments.size() - 1 - s) % 2 == 0 ? result : scratch;
+        run_segment(*source, segments[s], output);
+        source = &output;
+    }
+}
+
+/**
+ * Runs a filter recipe on an image, replacing it with the result
+ * Point filters and half turns work in the image's own buffer; only a
+ * quarter turn or an enlargement needs a second image
+ * @param image    The image
+ * @param segments The recipe, planned by plan_pipeline()
+ * @return nothing
+ */
+void run_pipeline_in_place(Image& image, const vector<PipelineSegment>& segments)
+{
+    Image scratch;
+    for(size_t s=0; s<segments.size(); s++)
+    {
+        const PipelineSegment& segment = segments[s];
+        bool new_shape = segment.geometry == 4 || segment.geometry == 6
+            || (segment.geometry == 5 && rotation_turns(segment.geometry_stage.number) % 2 == 1);
+        if(new_shape)
+        {
+            run_segment(image, segment, scratch);
+            swap(image, scratch);
+        }
+        else
+        {
+            run_segment(image, segment, image);
+        }
+    }
+}
+
+/**
+ * Runs a filter recipe with as few full-size images as possible
+ * @param image  The source image
+ * @param stages The recipe
+ * @param result The destination, reshaped to fit; not the source
+ * @return nothing
+ */
+void run_pipeline(const Image& image, const vector<FilterStage>& stages, Image& result)
+{
+    PROFILE_SCOPE("pipeline " + format_recipe(stages));
+    run_pipeline(image, plan_pipeline(stages), result);
+    PROFILE_COUNTS((long)image.width * image.height * 3, (long)result.width * result.height * 3,
+                   (long)image.width * image.height);
+}
+
+/**
+ * Runs a filter recipe with as few full-size images as possible
+ * @param image  The source image
+ * @param stages The recipe
+ * @return the filtered image
+ */
+Image run_pipeline(const Image& image, const vector<FilterStage>& stages)
+{
+    Image result;
+    run_pipeline(image, stages, result);
+    return result;
+}
+
+/**
+ * Runs a filter recipe on an image the caller no longer needs, reusing its
+ * buffer where run_pipeline_in_place() can
+ * @param image  The source image
+ * @param stages The recipe
+ * @return the filtered image
+ */
+Image run_pipeline(Image&& image, const vector<FilterStage>& stages)
+{
+    PROFILE_SCOPE("pipeline " + format_recipe(stages));
+    // Counted on the input, so an enlargement's extra output is left out
+    PROFILE_COUNTS((long)image.width * image.height * 3, (long)image.width * image.height * 3,
+                   (long)image.width * image.height);
+    run_pipeline_in_place(image, plan_pipeline(stages));
+    return move(image);
+}
+
+/**
+ * Times every filter on an image at 1, 2, 4, ... up to the configured
+ * number of threads and prints the speedup over one thread
+ * @param filename BMP image filename
+ * @return True if the image could be read
+ */
+bool print_scaling_report(string filename)
+{
+    Image image = read_packed_image(filename);
+    if(image.width == 0)
+    {
+        cout << "Could not read " << filename << endl;
+        return false;
+    }
+
+    vector<int> thread_counts;
+    int max_threads = configured_threads();
+    for(int threads=1; threads<max_threads; threads*=2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    const char* names[] = { "Vignette", "Clarendon", "Grayscale", "Rotate 90", "Rotate 180",
+                            "Enlarge 2x2", "High contrast", "Lighten", "Darken", "Five colors" };
+    function<Image()> filters[] = {
+        [&]() { return process_1(image); },
+        [&]() { return process_2(image, 0.3); },
+        [&]() { return process_3(image); },
+        [&]() { return process_4(image); },
+        [&]() { return process_5(image, 2); },
+        [&]() { return process_6(image, 2, 2); },
+        [&]() { return process_7(image); },
+        [&]() { return process_8(image, 0.5); },
+        [&]() { return process_9(image, 0.5); },
+        [&]() { return process_10(image); }
+    };
+
+    cout << "Scaling report for " << filename << " (" << image.width << " x " << image.height << ")" << endl;
+    cout << "Best of 3 runs in milliseconds, speedup over 1 thread in brackets" << endl;
+    cout << left << setw(16) << "Filter" << right;
+    for(size_t t=0; t<thread_counts.size(); t++)
+    {
+        cout << setw(18) << (to_string(thread_counts[t]) + " threads");
+    }
+    cout << endl;
+
+    for(int f=0; f<10; f++)
+    {
+        cout << left << setw(16) << names[f] << right;
+        double single = 0;
+        for(size_t t=0; t<thread_counts.size(); t++)
+        {
+            set_thread_count(thread_counts[t]);
+            double best = 0;
+            for(int run=0; run<3; run++)
+            {
+                chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                Image result = filters[f]();
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                best = run == 0 ? ms : min(best, ms);
+            }
+            if(t == 0)
+            {
+                single = best;
+            }
+            ostringstream cell;
+            cell << fixed << setprecision(2) << best << " (" << setprecision(1) << single / best << "x)";
+            cout << setw(18) << cell.str();
+        }
+        cout << endl;
+    }
+    set_thread_count(max_threads);
+    return true;
+}
+
+// Halvings --pyramid writes: 1/2, 1/4 and 1/8 size copies of each result
+const int PYRAMID_LEVELS = 3;
+
+// Rows of an image in memory handed to the pyramid at a time
+const int PYRAMID_BAND_ROWS = 64;
+
+// One level of a pyramid: a BMP file written a band of rows at a time from
+// the rows of the level above as they arrive, top to bottom
+struct PyramidLevel
+{
+    string filename;
+    int fd;
+    int width;
+    int height;
+    Image rows;         // Rows made from the last rows handed down
+    Image carry;        // A row of the level above waiting for the row below it
+    bool carrying;
+    int next_row;       // Next row of this level to be made
+};
+
+/**
+ * Names the file of a pyramid level: out.bmp becomes out_1-2.bmp, out_1-4.bmp...
+ * @param filename The full size result's file name
+ * @param level    1 for half size, 2 for quarter size and so on
+ * @return the level's file name
+ */
+string pyramid_level_name(string filename, int level)
+{
+    string suffix = "_1-" + to_string(1 << level);
+    size_t dot = filename.rfind('.');
+    if(dot == string::npos || filename.find('/', dot) != string::npos)
+    {
+        return filename + suffix;
+    }
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+/**
+ * Creates the level files of a pyramid, each half the size of the one
+ * above, rounded up
+ * @param filename The full size result's file name
+ * @param width    Width of the full size result
+ * @param height   Height of the full size result
+ * @param levels   Number of levels
+ * @param pyramid  The open levels; those that could not be opened have fd -1
+ * @return True if every file was created
+ */
+bool open_pyramid(string filename, int width, int height, int levels, vector<PyramidLevel>& pyramid)
+{
+    pyramid.resize(levels);
+    bool success = true;
+    for(int l=0; l<levels; l++)
+    {
+        PyramidLevel& level = pyramid[l];
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        level.filename = pyramid_level_name(filename, l + 1);
+        level.width = width;
+        level.height = height;
+        level.rows = make_image(width, 0);
+        level.carry = make_image(0, 0);
+        level.carrying = false;
+        level.next_row = 0;
+        level.fd = open(level.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        unsigned char header[54] = {0};
+        set_bmp_headers(header, width, height);
+        vector<struct iovec> parts(1);
+        parts[0].iov_base = header;
+        parts[0].iov_len = sizeof(header);
+        success = level.fd >= 0 && write_all(level.fd, parts) && success;
+    }
+    return success;
+}
+
+/**
+ * Averages two rows into one of half the width, rounded up; an odd last
+ * column is averaged on its own
+ * @param top    The upper row
+ * @param bottom The lower row, or the upper row again for an odd last row
+ * @param dst    The half width row
+ * @param width  Width of the source rows in pixels
+ * @return nothing
+ */
+void downsample_row(const unsigned char* top, const unsigned char* bottom, unsigned char* dst, int width)
+{
+    simd_kernels().downsample(top, bottom, dst, width / 2);
+    if(width % 2 == 1)
+    {
+        int last = 3 * (width - 1);
+        for(int channel=0; channel<3; channel++)
+        {
+            dst[last / 2 + channel] = (top[last + channel] + bottom[last + channel] + 1) >> 1;
+        }
+    }
+}
+
+/**
+ * Hands rows of the level above, top to bottom, to a pyramid level: each
+ * pair of rows becomes a row of the level, which is written and handed on
+ * to the next level in turn
+ * A row without its pair waits for the next call, unless these are the
+ * last rows, when it is averaged on its own
+ * @param pyramid The open levels
+ * @param level   The level to make rows of
+ * @param rows    The rows of the level above, as many as there are
+ * @param width   Width of the rows in pixels
+ * @param last    True if no rows come after these
+ * @return True if the rows of every level were written
+ */
+bool add_pyramid_rows(vector<PyramidLevel>& pyramid, size_t level, const vector<const unsigned char*>& rows,
+                      int width, bool last)
+{
+    PyramidLevel& out = pyramid[level];
+    vector<const unsigned char*> sources;
+    if(out.carrying)
+    {
+        sources.push_back(image_row(out.carry, 0));
+    }
+    sources.insert(sources.end(), rows.begin(), rows.end());
+    const unsigned char* waiting = nullptr;
+    if(sources.size() % 2 == 1 && last)
+    {
+        sources.push_back(sources.back());
+    }
+    else if(sources.size() % 2 == 1)
+    {
+        waiting = sources.back();
+        sources.pop_back();
+    }
+
+    // Padding stays zero: rows are only ever written width pixels wide
+    int count = sources.size() / 2;
+    if(out.rows.height < count)
+    {
+        out.rows = make_image(out.width, count);
+    }
+    parallel_rows(count, [&](int first_row, int last_row)
+    {
+        for(int r=first_row; r<last_row; r++)
+        {
+            downsample_row(sources[2*r], sources[2*r + 1], image_row(out.rows, r), width);
+        }
+    });
+
+    // Kept only now, as the carried row may have been one of the pairs
+    out.carrying = waiting != nullptr;
+    if(out.carrying && (out.carry.height == 0 || waiting != image_row(out.carry, 0)))
+    {
+        if(out.carry.height == 0)
+        {
+            out.carry = make_uninitialized_image(width, 1);
+        }
+        memcpy(image_row(out.carry, 0), waiting, 3 * width);
+    }
+
+    // Rows are stored bottom to top, so the new rows are one block of the file
+    int stride = out.rows.stride;
+    vector<struct iovec> parts(count);
+    vector<const unsigned char*> made(count);
+    for(int k=0; k<count; k++)
+    {
+        parts[k].iov_base = image_row(out.rows, (count-1) - k);
+        parts[k].iov_len = stride;
+        made[k] = image_row(out.rows, k);
+    }
+    off_t offset = 54 + (off_t)(out.height - (out.next_row + count)) * stride;
+    out.next_row += count;
+    if(count > 0 && !transfer_at(true, out.fd, offset, parts))
+    {
+        return false;
+    }
+    if(level + 1 == pyramid.size() || (count == 0 && !last))
+    {
+        return true;
+    }
+    return add_pyramid_rows(pyramid, level + 1, made, out.width, last);
+}
+
+/**
+ * Closes the level files of a pyramid
+ * @param pyramid The levels
+ * @param keep    False to remove the files, after a failure
+ * @return True if the files were kept and closed cleanly
+ */
+bool close_pyramid(vector<PyramidLevel>& pyramid, bool keep)
+{
+    for(size_t l=0; l<pyramid.size(); l++)
+    {
+        if(pyramid[l].fd >= 0)
+        {
+            keep = close(pyramid[l].fd) == 0 && keep;
+        }
+    }
+    for(size_t l=0; !keep && l<pyramid.size(); l++)
+    {
+        unlink(pyramid[l].filename.c_str());
+    }
+    pyramid.clear();
+    return keep;
+}
+
+/**
+ * Writes the pyramid levels of an image in memory, handing its rows down
+ * a band at a time so that the level buffers stay small
+ * @param filename The full size result's file name
+ * @param image    The full size result
+ * @param levels   Number of levels
+ * @return True if every level was written
+ */
+bool write_pyramid(string filename, const Image& image, int levels)
+{
+    PROFILE_SCOPE("pyramid");
+    vector<PyramidLevel> pyramid;
+    bool success = open_pyramid(filename, image.width, image.height, levels, pyramid);
+    vector<const unsigned char*> rows;
+    for(int first_row=0; first_row<image.height && success; first_row+=PYRAMID_BAND_ROWS)
+    {
+        int last_row = min(image.height, first_row + PYRAMID_BAND_ROWS);
+        rows.clear();
+        for(int r=first_row; r<last_row; r++)
+        {
+            rows.push_back(image_row(image, r));
+        }
+        success = add_pyramid_rows(pyramid, 0, rows, image.width, last_row == image.height);
+    }
+    PROFILE_COUNTS((long)image.stride * image.height, (long)image.stride * image.height / 3,
+                   (long)image.width * image.height);
+    return close_pyramid(pyramid, success);
+}
+
+/**
+ * Writes a filter result: as a paletted BMP when palette_output() is set and
+ * the image has few enough colors, otherwise as a 24 bit BMP, and then its
+ * pyramid_levels() reduced copies
+ * @param filename The BMP file name to save the image to
+ * @param image    The image to save
+ * @return True if successful and false otherwise
+ */
+bool write_result_image(string filename, const Image& image)
+{
+    vector<unsigned char> file;
+    bool success = palette_output() && encode_paletted_image(image, file) ? write_encoded_file(filename, file)
+                                                                          : write_packed_image(filename, image);
+    return success && (pyramid_levels() == 0 || write_pyramid(filename, image, pyramid_levels()));
+}
+
+// Queue of fixed capacity between two threads: push waits while the queue
+// is full and pop waits while it is empty, until the queue is closed
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(max((size_t)1, capacity)), closed(false)
+    {
+    }
+
+    void push(T item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_full.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(move(item));
+        not_empty.notify_one();
+    }
+
+    // Adds an item without waiting; returns false, leaving the item with the
+    // caller, if the queue is full or closed
+    bool try_push(T& item)
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if(items.size() >= capacity || closed)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        not_empty.wait(lock, [this]() { return !items.empty() || closed; });
+        if(items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // No more items will be pushed
+    void close()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    size_t size()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        return items.size();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex queue_mutex;
+    condition_variable not_full;
+    condition_variable not_empty;
+};
+
+// One file moving through a batch run
+struct BatchJob
+{
+    string input;
+    string output;
+    Image image;
+    bool success;
+    string error;
+    long pixels;            // Pixels of the output image
+    long bytes_in;
+    long bytes_out;
+    double decode_ms;
+    double filter_ms;
+    double encode_ms;
+};
+
+// Milliseconds since a steady clock time point
+double elapsed_ms(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Size of a file in bytes, or 0 if it cannot be read
+long file_bytes(string filename)
+{
+    struct stat info;
+    return stat(filename.c_str(), &info) == 0 ? (long)info.st_size : 0;
+}
+
+// Asks the kernel to start reading a file into the page cache
+void prefetch_file(string filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/**
+ * Lists the input files of a batch
+ * @param spec A glob pattern such as "*.bmp", or "@FILE" for a
+ *             manifest file with one path per line
+ * @param inputs The matching paths, in order
+ * @return True if the pattern or manifest could be read
+ */
+bool list_batch_inputs(string spec, vector<string>& inputs)
+{
+    inputs.clear();
+    if(!spec.empty() && spec[0] == '@')
+    {
+        fstream manifest;
+        manifest.open(spec.substr(1), ios::in);
+        if(!manifest.is_open())
+        {
+            return false;
+        }
+        string line;
+        while(getline(manifest, line))
+        {
+            if(!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.erase(line.size() - 1);
+            }
+            if(!line.empty() && line[0] != '#')
+            {
+                inputs.push_back(line);
+            }
+        }
+        return true;
+    }
+
+    glob_t matches;
+    int status = glob(spec.c_str(), 0, nullptr, &matches);
+    if(status == 0)
+    {
+        for(size_t i=0; i<matches.gl_pathc; i++)
+        {
+            inputs.push_back(matches.gl_pathv[i]);
+        }
+    }
+    globfree(&matches);
+    return status == 0 || status == GLOB_NOMATCH;
+}
+
+/**
+ * Names the result of each batch input: its file name in the output
+ * directory, or for inputs from different directories that share a file
+ * name, that name with -2, -3 and so on before the extension
+ * @param inputs     The input paths, in order
+ * @param output_dir Directory for the results
+ * @return the output path of each input
+ */
+vector<string> batch_output_names(const vector<string>& inputs, string output_dir)
+{
+    vector<string> names;
+    for(size_t i=0; i<inputs.size(); i++)
+    {
+        size_t slash = inputs[i].find_last_of('/');
+        names.push_back(slash == string::npos ? inputs[i] : inputs[i].substr(slash + 1));
+    }
+
+    // Every plain name stays with the first input that has it, so a suffixed
+    // name never takes the name of a later input
+    set<string> taken(names.begin(), names.end());
+    set<string> used;
+    vector<string> outputs;
+    for(size_t i=0; i<names.size(); i++)
+    {
+        string name = names[i];
+        if(used.count(name) > 0)
+        {
+            size_t dot = name.find_last_of('.');
+            string stem = dot == string::npos ? name : name.substr(0, dot);
+            string extension = dot == string::npos ? "" : name.substr(dot);
+            for(int copy=2; taken.count(name) > 0; copy++)
+            {
+                name = stem + "-" + to_string(copy) + extension;
+            }
+            taken.insert(name);
+        }
+        used.insert(name);
+        outputs.push_back(output_dir + "/" + name);
+    }
+    return outputs;
+}
+
+/**
+ * Applies a filter recipe to many files in one run
+ * Decoding, filtering and encoding run on their own threads, joined by
+ * queues of `in_flight` images, so file N+1 is read while file N is
+ * filtered and file N-1 is written, and at most about 3 * in_flight images
+ * are in memory at once. Filtering uses the scheduler's threads.
+ * @param spec       Input files, see list_batch_inputs()
+ * @param recipe     Filter recipe, see parse_recipe()
+ * @param output_dir Directory for the results, created if missing, named
+ *                   by batch_output_names()
+ * @param in_flight  Images allowed to wait between stages
+ * @return True if every file was processed
+ */
+bool run_batch(string spec, string recipe, string output_dir, int in_flight)
+{
+    vector<FilterStage> stages;
+    if(!parse_recipe(recipe, stages))
+    {
+        cout << "Invalid recipe: " << recipe << endl;
+        return false;
+    }
+    vector<string> inputs;
+    if(!list_batch_inputs(spec, inputs))
+    {
+        cout << "Could not read inputs: " << spec << endl;
+        return false;
+    }
+    if(mkdir(output_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cout << "Could not create output directory: " << output_dir << endl;
+        return false;
+    }
+    vector<string> outputs = batch_output_names(inputs, output_dir);
+    for(size_t i=0; i<inputs.size(); i++)
+    {
+        size_t slash = inputs[i].find_last_of('/');
+        if(outputs[i] != output_dir + "/" + (slash == string::npos ? inputs[i] : inputs[i].substr(slash + 1)))
+        {
+            cout << inputs[i] << ": written as " << outputs[i] << ", the name is taken" << endl;
+        }
+    }
+
+    BoundedQueue<unique_ptr<BatchJob>> decoded(in_flight);
+    BoundedQueue<unique_ptr<BatchJob>> filtered(in_flight);
+    vector<unique_ptr<BatchJob>> finished;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    BufferPoolStats buffers_before = buffer_pool_stats();
+
+    thread decoder([&]()
+    {
+        for(size_t i=0; i<inputs.size(); i++)
+        {
+            // The next file is read from disk while this one is decoded
+            if(i + 1 < inputs.size())
+            {
+                prefetch_file(inputs[i + 1]);
+            }
+            unique_ptr<BatchJob> job(new BatchJob());
+            job->input = inputs[i];
+            job->output = outputs[i];
+
+            chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+            job->image = read_packed_image(job->input);
+            job->decode_ms = elapsed_ms(begin);
+            job->bytes_in = file_bytes(job->input);
+            job->success = job->image.width > 0;
+            if(!job->success)
+            {
+                job->error = "not a readable BMP";
+            }
+            decoded.push(move(job));
+        }
+        decoded.close();
+    });
+
+    thread encoder([&]()
+    {
+        unique_ptr<BatchJob> job;
+        while(filtered.pop(job))
+        {
+            if(job->success)
+            {
+                chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+                job->success = write_result_image(job->output, job->image);
+                job->encode_ms = elapsed_ms(begin);
+                job->bytes_out = file_bytes(job->output);
+                if(!job->success)
+                {
+                    job->error = "could not write " + job->output;
+                }
+            }
+            job->image = Image();
+
+            // Per-file line: input, size, stage times and throughput
+            if(job->success)
+            {
+                double total = job->decode_ms + job->filter_ms + job->encode_ms;
+                cout << job->input << ": " << fixed << setprecision(1)
+                     << job->pixels / 1e6 << " MP, decode " << job->decode_ms << " ms, filter "
+                     << job->filter_ms << " ms, encode " << job->encode_ms << " ms, "
+                     << (total > 0 ? job->pixels / 1e3 / total : 0) << " MP/s" << endl;
+            }
+            else
+            {
+                cout << job->input << ": FAILED, " << job->error << endl;
+            }
+            finished.push_back(move(job));
+        }
+    });
+
+    // Filter on this thread, in parallel bands on the scheduler
+    vector<PipelineSegment> plan = plan_pipeline(stages);
+    unique_ptr<BatchJob> job;
+    while(decoded.pop(job))
+    {
+        if(job->success && !pipeline_fits(plan, job->image.width, job->image.height))
+        {
+            job->success = false;
+            job->error = "result too large";
+        }
+        if(job->success)
+        {
+            chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+            job->image = run_pipeline(move(job->image), stages);
+            job->filter_ms = elapsed_ms(begin);
+            job->pixels = (long)job->image.width * job->image.height;
+        }
+        filtered.push(move(job));
+    }
+    filtered.close();
+    decoder.join();
+    encoder.join();
+
+    // Aggregate throughput over the wall time of the whole run
+    double wall_ms = elapsed_ms(start);
+    int succeeded = 0;
+    long pixels = 0;
+    long bytes = 0;
+    for(size_t i=0; i<finished.size(); i++)
+    {
+        if(finished[i]->success)
+        {
+            succeeded++;
+            pixels += finished[i]->pixels;
+            bytes += finished[i]->bytes_in + finished[i]->bytes_out;
+        }
+    }
+    double seconds = wall_ms / 1000;
+    cout << "Batch: " << succeeded << " of " << inputs.size() << " files in " << fixed << setprecision(1)
+         << wall_ms << " ms, " << (seconds > 0 ? succeeded / seconds : 0) << " files/s, "
+         << (seconds > 0 ? pixels / 1e6 / seconds : 0) << " MP/s, "
+         << (seconds > 0 ? bytes / 1e6 / seconds : 0) << " MB/s read+written" << endl;
+
+    // Once the pool holds a buffer for each image in flight, frames of the
+    // same size stop allocating
+    BufferPoolStats buffers = buffer_pool_stats();
+    cout << "Image buffers: " << buffers.allocated - buffers_before.allocated << " allocated, "
+         << buffers.reused - buffers_before.reused << " reused" << endl;
+    return succeeded == (int)inputs.size();
+}
+
+// Reads and writes at file offsets that go on while the caller computes.
+// They go through io_uring where the kernel allows it, otherwise through a
+// helper thread; setting the environment variable IMAGE_IO to "threads"
+// forces the thread. The buffers must stay untouched until wait() returns.
+class IoQueue
+{
+public:
+    IoQueue() : next_ticket(0), ring_fd(-1), in_flight(0), stopping(false)
+    {
+#ifdef IMAGE_IO_URING
+        const char* choice = getenv("IMAGE_IO");
+        if(choice == nullptr || string(choice) != "threads")
+        {
+            open_ring();
+        }
+#endif
+        if(ring_fd < 0)
+        {
+            helper = thread(&IoQueue::helper_loop, this);
+        }
+    }
+
+    // Waits for every request still in flight
+    ~IoQueue()
+    {
+        while(!requests.empty())
+        {
+            wait(requests.begin()->first);
+        }
+        if(helper.joinable())
+        {
+            {
+                lock_guard<mutex> lock(queue_mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            helper.join();
+        }
+#ifdef IMAGE_IO_URING
+        if(ring_fd >= 0)
+        {
+            munmap(sq_ring, sq_ring_bytes);
+            if(cq_ring != sq_ring)
+            {
+                munmap(cq_ring, cq_ring_bytes);
+            }
+            munmap(sqes, sqe_bytes);
+            close(ring_fd);
+        }
+#endif
+    }
+
+    string backend() const
+    {
+        return ring_fd >= 0 ? "io_uring" : "thread";
+    }
+
+    /**
+     * Starts reading or writing a list of buffers at a file offset
+     * @param write  True to write the buffers, false to fill them
+     * @param fd     The open file descriptor
+     * @param offset File offset of the first byte
+     * @param parts  The buffers, in order
+     * @return a ticket for wait()
+     */
+    int submit(bool write, int fd, off_t offset, const vector<struct iovec>& parts)
+    {
+        int ticket = next_ticket++;
+        shared_ptr<IoRequest> request = make_shared<IoRequest>();
+        request->write = write;
+        request->fd = fd;
+        request->offset = offset;
+        request->parts = parts;
+        request->pending = 0;
+        request->success = true;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            requests[ticket] = request;
+            if(ring_fd < 0)
+            {
+                waiting.push_back(ticket);
+                wake.notify_one();
+                return ticket;
+            }
+        }
+#ifdef IMAGE_IO_URING
+        submit_to_ring(ticket, *request);
+#endif
+        return ticket;
+    }
+
+    /**
+     * Waits for a request to finish
+     * @param ticket From submit()
+     * @return True if every byte was transferred
+     */
+    bool wait(int ticket)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        map<int, shared_ptr<IoRequest>>::iterator found = requests.find(ticket);
+        if(found == requests.end())
+        {
+            return false;
+        }
+        shared_ptr<IoRequest> request = found->second;
+        if(ring_fd < 0)
+        {
+            done.wait(lock, [&]() { return request->finished; });
+        }
+#ifdef IMAGE_IO_URING
+        else
+        {
+            lock.unlock();
+            while(request->pending > 0)
+            {
+                wait_for_ring(1);
+            }
+            lock.lock();
+        }
+#endif
+        requests.erase(ticket);
+        return request->success;
+    }
+
+private:
+    // One submitted list of buffers
+    struct IoRequest
+    {
+        bool write;
+        int fd;
+        off_t offset;
+        vector<struct iovec> parts;
+        int pending;        // Ring operations not yet completed
+        bool finished;      // Done by the helper thread
+        bool success;
+
+        IoRequest() : finished(false)
+        {
+        }
+    };
+
+    // Runs requests on the helper thread in the order they were submitted
+    void helper_loop()
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        while(true)
+        {
+            wake.wait(lock, [this]() { return !waiting.empty() || stopping; });
+            if(waiting.empty())
+            {
+                return;
+            }
+            shared_ptr<IoRequest> request = requests[waiting.front()];
+            waiting.pop_front();
+            lock.unlock();
+            bool success = transfer_at(request->write, request->fd, request->offset, request->parts);
+            lock.lock();
+            request->success = success;
+            request->finished = true;
+            done.notify_all();
+        }
+    }
+
+#ifdef IMAGE_IO_URING
+    // Entries of the submission ring; a request of many rows takes one entry
+    // per IOV_MAX buffers
+    static const unsigned RING_ENTRIES = 32;
+
+    int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    // Sets up the ring, leaving ring_fd negative if the kernel refuses
+    void open_ring()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if(fd < 0)
+        {
+            return;
+        }
+        sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if(single_map)
+        {
+            sq_ring_bytes = cq_ring_bytes = max(sq_ring_bytes, cq_ring_bytes);
+        }
+        sqe_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+        sq_ring = mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ring = single_map ? sq_ring
+                  : mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void* entries = mmap(nullptr, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || entries == MAP_FAILED)
+        {
+            if(sq_ring != MAP_FAILED)
+            {
+                munmap(sq_ring, sq_ring_bytes);
+            }
+            if(cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            {
+                munmap(cq_ring, cq_ring_bytes);
+            }
+            if(entries != MAP_FAILED)
+            {
+                munmap(entries, sqe_bytes);
+            }
+            close(fd);
+            return;
+        }
+
+        char* sq = (char*)sq_ring;
+        char* cq = (char*)cq_ring;
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+        sqes = (struct io_uring_sqe*)entries;
+        ring_size = params.sq_entries;
+        ring_fd = fd;
+    }
+
+    // Queues one readv or writev per IOV_MAX buffers of a request
+    void submit_to_ring(int ticket, IoRequest& request)
+    {
+        off_t offset = request.offset;
+        for(size_t first=0; first<request.parts.size(); first+=IOV_MAX)
+        {
+            size_t count = min(request.parts.size() - first, (size_t)IOV_MAX);
+            // Never more operations in flight than the completion ring holds
+            while(in_flight >= (int)ring_size)
+            {
+                wait_for_ring(1);
+            }
+            unsigned tail = *sq_tail;
+            unsigned index = tail & sq_mask;
+            struct io_uring_sqe& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.fd = request.fd;
+            sqe.off = offset;
+            sqe.addr = (unsigned long)&request.parts[first];
+            sqe.len = count;
+            sqe.user_data = ((unsigned long long)ticket << 32) | first;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            request.pending++;
+            in_flight++;
+            for(size_t k=first; k<first+count; k++)
+            {
+                offset += request.parts[k].iov_len;
+            }
+
+            int submitted;
+            do
+            {
+                submitted = ring_enter(1, 0, 0);
+            } while(submitted < 0 && errno == EINTR);
+            if(submitted != 1)
+            {
+                // The kernel did not take the entry (an error, or 0 when it
+                // is short of resources), so it is still ours: do it here instead
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                request.pending--;
+                in_flight--;
+                vector<struct iovec> chunk(request.parts.begin() + first, request.parts.begin() + first + count);
+                request.success = transfer_at(request.write, request.fd, sqe.off, chunk) && request.success;
+            }
+        }
+    }
+
+    // Waits until at least min_complete operations have completed, then
+    // settles every completed one
+    void wait_for_ring(unsigned min_complete)
+    {
+        if(__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head)
+        {
+            while(ring_enter(0, min_complete, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR)
+            {
+            }
+        }
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for(; head!=tail; head++)
+        {
+            const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+            IoRequest& request = *requests[(int)(cqe.user_data >> 32)];
+            size_t first = (size_t)(cqe.user_data & 0xffffffffu);
+            size_t last = min(request.parts.size(), first + IOV_MAX);
+            off_t offset = request.offset;
+            for(size_t k=0; k<first; k++)
+            {
+                offset += request.parts[k].iov_len;
+            }
+            size_t expected = 0;
+            for(size_t k=first; k<last; k++)
+            {
+                expected += request.parts[k].iov_len;
+            }
+
+            if(cqe.res != (int)expected)
+            {
+                // Finish a short transfer, or retry an interrupted one, here
+                bool retry = cqe.res >= 0 || cqe.res == -EINTR || cqe.res == -EAGAIN;
+                vector<struct iovec> rest(request.parts.begin() + first, request.parts.begin() + last);
+                size_t done = cqe.res > 0 ? cqe.res : 0;
+                size_t k = 0;
+                while(done > 0 && done >= rest[k].iov_len)
+                {
+                    done -= rest[k].iov_len;
+                    offset += rest[k].iov_len;
+                    k++;
+                }
+                rest.erase(rest.begin(), rest.begin() + k);
+                if(!rest.empty())
+                {
+                    rest[0].iov_base = (char*)rest[0].iov_base + done;
+                    rest[0].iov_len -= done;
+                    offset += done;
+                }
+                request.success = retry && transfer_at(request.write, request.fd, offset, rest) && request.success;
+            }
+            request.pending--;
+            in_flight--;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+#endif
+
+    int next_ticket;
+    int ring_fd;
+    int in_flight;
+    map<int, shared_ptr<IoRequest>> requests;
+    deque<int> waiting;         // Tickets for the helper thread, oldest first
+    bool stopping;
+    mutex queue_mutex;
+    condition_variable wake;
+    condition_variable done;
+    thread helper;
+#ifdef IMAGE_IO_URING
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_bytes;
+    size_t cq_ring_bytes;
+    size_t sqe_bytes;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_sqe* sqes;
+    unsigned ring_size;
+#endif
+};
+
+// Default memory for the row bands of a streamed recipe, in megabytes
+const int STREAM_MEGABYTES = 64;
+
+// A BMP file read a band of rows at a time
+struct StreamInput
+{
+    int fd;
+    BmpHeader header;
+    vector<unsigned char> scanlines;    // 32 bit rows before the alpha is dropped
+    Image block;                        // Whole rows read for a column band
+};
+
+// A 24 bit BMP file written a band of rows at a time, in any order
+struct StreamOutput
+{
+    int fd;
+    int width;
+    int height;
+    int stride;
+};
+
+/**
+ * Opens a BMP file for reading in bands
+ * @param filename BMP image filename
+ * @param input    The open file and its header
+ * @return True if the file is a valid 24 or 32 bit image
+ */
+bool open_stream_input(string filename, StreamInput& input)
+{
+    fstream stream;
+    stream.open(filename, ios::in | ios::binary);
+    if(!stream.is_open() || !read_bmp_header(stream, input.header) || input.header.bits_per_pixel < 24)
+    {
+        return false;
+    }
+    stream.close();
+    input.block = make_image(0, 0);
+    input.fd = open(filename.c_str(), O_RDONLY);
+    return input.fd >= 0;
+}
+
+/**
+ * Lists the buffers that rows [first_row, first_row + rows) of a streamed
+ * BMP are read into: the first rows of a band, top to bottom, or for 32 bit
+ * files the scan lines
+ * @param input     The open file
+ * @param first_row Top row to read
+ * @param rows      Number of rows
+ * @param band      Destination as wide as the file, at least `rows` high
+ * @param scanlines Resized to hold 32 bit rows
+ * @param parts     The buffers, in file order
+ * @return the file offset of the rows, which are one block of the file
+ */
+off_t stream_row_parts(const StreamInput& input, int first_row, int rows, Image& band,
+                       vector<unsigned char>& scanlines, vector<struct iovec>& parts)
+{
+    const BmpHeader& header = input.header;
+    if(header.bits_per_pixel == 24)
+    {
+        parts.resize(rows);
+        for(int k=0; k<rows; k++)
+        {
+            parts[k].iov_base = image_row(band, header.top_down ? k : (rows-1)-k);
+            parts[k].iov_len = header.row_bytes;
+        }
+    }
+    else
+    {
+        scanlines.resize((size_t)rows * header.row_bytes);
+        parts.resize(1);
+        parts[0].iov_base = scanlines.data();
+        parts[0].iov_len = scanlines.size();
+    }
+
+    // The bottom row comes first unless the file is top-down
+    int first_file_row = header.top_down ? first_row : header.height - (first_row + rows);
+    return header.start + (off_t)first_file_row * header.row_bytes;
+}
+
+/**
+ * Completes rows read into the buffers of stream_row_parts(), dropping any
+ * alpha and zeroing the padding
+ * @param input     The open file
+ * @param rows      Number of rows
+ * @param band      The band the rows were read for
+ * @param scanlines The 32 bit rows, if the file has them
+ * @return nothing
+ */
+void finish_stream_rows(const StreamInput& input, int rows, Image& band, const vector<unsigned char>& scanlines)
+{
+    const BmpHeader& header = input.header;
+    int used = header.width * 3;
+    for(int k=0; k<rows; k++)
+    {
+        unsigned char* row = image_row(band, header.top_down ? k : (rows-1)-k);
+        if(header.bits_per_pixel == 32)
+        {
+            const unsigned char* src = scanlines.data() + (size_t)k * header.row_bytes;
+            for(int c=0; c<header.width; c++)
+            {
+                row[3*c] = src[0];
+                row[3*c + 1] = src[1];
+                row[3*c + 2] = src[2];
+                src += 4;
+            }
+        }
+        fill(row + used, row + band.stride, 0);
+    }
+}
+
+/**
+ * Reads rows [first_row, first_row + rows) of a streamed BMP into the first
+ * rows of a band, top to bottom, dropping any alpha and zeroing the padding
+ * @param input     The open file
+ * @param first_row Top row to read
+ * @param rows      Number of rows
+ * @param band      Destination as wide as the file, at least `rows` high
+ * @return True if the rows could be read
+ */
+bool read_stream_rows(StreamInput& input, int first_row, int rows, Image& band)
+{
+    vector<struct iovec> parts;
+    off_t offset = stream_row_parts(input, first_row, rows, band, input.scanlines, parts);
+    if(!transfer_at(false, input.fd, offset, parts))
+    {
+        return false;
+    }
+    finish_stream_rows(input, rows, band, input.scanlines);
+    return true;
+}
+
+/**
+ * Reads columns [first_column, first_column + columns) of every row of a
+ * streamed BMP, a block of whole rows at a time
+ * @param input        The open file
+ * @param first_column Leftmost column to read
+ * @param columns      Number of columns
+ * @param slice        Destination of `columns` by the file's height
+ * @return True if the rows could be read
+ */
+bool read_stream_columns(StreamInput& input, int first_column, int columns, Image& slice)
+{
+    int width = input.header.width;
+    int height = input.header.height;
+    if(input.block.width != width)
+    {
+        int block_rows = max(1, min(height, (1 << 20) / input.header.row_bytes));
+        input.block = make_uninitialized_image(width, block_rows);
+    }
+
+    for(int first_row=0; first_row<height; first_row+=input.block.height)
+    {
+        int rows = min(input.block.height, height - first_row);
+        if(!read_stream_rows(input, first_row, rows, input.block))
+        {
+            return false;
+        }
+        for(int k=0; k<rows; k++)
+        {
+            const unsigned char* row = image_row(input.block, k) + 3 * first_column;
+            copy(row, row + 3 * columns, image_row(slice, first_row + k));
+        }
+    }
+    return true;
+}
+
+/**
+ * Creates a 24 bit BMP file to be written in bands
+ * @param filename The BMP file name to save the image to
+ * @param width    Width of the image in pixels
+ * @param height   Height of the image in pixels
+ * @param output   The open file
+ * @return True if the file was created; BMP files are limited to 4 GB
+ */
+bool open_stream_output(string filename, int width, int height, StreamOutput& output)
+{
+    unsigned char header[54] = {0};
+    long file_size = set_bmp_headers(header, width, height);
+    if(file_size > (long)UINT_MAX)
+    {
+        return false;
+    }
+
+    output.fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(output.fd < 0)
+    {
+        return false;
+    }
+    output.width = width;
+    output.height = height;
+    output.stride = make_image(width, 0).stride;
+
+    vector<struct iovec> parts(1);
+    parts[0].iov_base = header;
+    parts[0].iov_len = sizeof(header);
+    return write_all(output.fd, parts);
+}
+
+/**
+ * Lists the buffers that write the first `rows` rows of a band, each
+ * `repeat` times, as rows first_row onwards; repeated rows are the same
+ * buffer written again
+ * Rows are stored bottom to top, so a band is one block of the file and
+ * bands may be written in any order
+ * @param output    The open file
+ * @param first_row Image row of the first band row
+ * @param band      Rows as wide as the image, with zero padding
+ * @param rows      Number of band rows to write
+ * @param repeat    Number of image rows each band row fills
+ * @param parts     The buffers, in file order
+ * @return the file offset of the block
+ */
+off_t stream_write_parts(const StreamOutput& output, int first_row, const Image& band, int rows, int repeat,
+                         vector<struct iovec>& parts)
+{
+    int count = rows * repeat;
+    parts.resize(count);
+    for(int k=0; k<count; k++)
+    {
+        parts[k].iov_base = (void*)image_row(band, ((count-1)-k) / repeat);
+        parts[k].iov_len = output.stride;
+    }
+    return 54 + (off_t)(output.height - (first_row + count)) * output.stride;
+}
+
+// One read through a file in a streamed recipe: an optional rotation, which
+// needs every source row for each band, then row by row segments
+struct StreamPass
+{
+    int turns;                          // Quarter turns clockwise, 0 to 3
+    vector<PipelineSegment> segments;   // Enlargements and point filters only
+};
+
+// Sets of band buffers in a streamed pass: while one band is filtered, the
+// next is read into another set and the one before is written from the third
+const int STREAM_SLOTS = 3;
+
+// One set of band buffers and the I/O in flight on them
+struct StreamSlot
+{
+    vector<Image> bands;                // Each buffer a band goes through
+    Image source;                       // Rows or columns before a rotation
+    vector<unsigned char> scanlines;    // 32 bit rows before the alpha is dropped
+    int reading;                        // Ticket of the read into the slot, or -1
+    int writing;                        // Ticket of the write from the slot, or -1
+};
+
+/**
+ * Splits a recipe into streamed passes, starting a new pass at each rotation
+ * @param stages The recipe
+ * @return the passes to run in order, at least one
+ */
+vector<StreamPass> plan_stream(const vector<FilterStage>& stages)
+{
+    vector<PipelineSegment> segments = plan_pipeline(stages);
+    vector<StreamPass> passes;
+    for(size_t i=0; i<segments.size(); i++)
+    {
+        PipelineSegment segment = segments[i];
+        int turns = segment.geometry == 4 ? 1 : (segment.geometry == 5 ? rotation_turns(segment.geometry_stage.number) : 0);
+        if(turns != 0 || passes.empty())
+        {
+            StreamPass pass;
+            pass.turns = turns;
+            passes.push_back(pass);
+        }
+        if(turns != 0)
+        {
+            segment.geometry = 0;
+        }
+        passes.back().segments.push_back(segment);
+    }
+    if(passes.empty())
+    {
+        StreamPass pass;
+        pass.turns = 0;
+        passes.push_back(pass);
+    }
+    return passes;
+}
+
+/**
+ * Runs one streamed pass from a BMP file to another
+ * The pass works on bands of output rows before any enlargement. Each band
+ * is read (with a 180 degree turn, the mirrored rows; with a quarter turn,
+ * a band of columns from every row), enlarged and filtered in place, then
+ * written, so memory only grows with the width and the band height.
+ * Enlargements only widen the band rows: the rows they repeat are written
+ * from the same buffer, and only made for real ahead of a vignette, whose
+ * factors change from row to row. Reads and writes go through an IoQueue,
+ * so the next band is read and the previous one written while a band is
+ * filtered; the budget is shared by the STREAM_SLOTS sets of buffers.
+ * With pyramid levels, each finished band is also handed down the pyramid
+ * while it is written, so the reduced copies need no pass of their own.
+ * @param input_name   Source BMP file
+ * @param output_name  Destination BMP file
+ * @param pass         The pass
+ * @param budget       Bytes allowed for the bands
+ * @param pyramid_name File name the level files are named after
+ * @param levels       Number of pyramid levels, 0 for none
+ * @param band_rows    Set to the rows per band before enlargement
+ * @return True if successful and false otherwise
+ */
+bool run_stream_pass(string input_name, string output_name, const StreamPass& pass, long budget,
+                     string pyramid_name, int levels, int& band_rows)
+{
+    PROFILE_SCOPE("stream pass");
+    StreamInput input;
+    if(!open_stream_input(input_name, input))
+    {
+        return false;
+    }
+
+    // Sizes after the rotation and after each enlargement
+    int width = pass.turns % 2 == 1 ? input.header.height : input.header.width;
+    int height = pass.turns % 2 == 1 ? input.header.width : input.header.height;
+    int out_width = width;
+    int out_height = height;
+
+    // Width and rows per band row of each buffer a band goes through
+    vector<pair<int, long>> shapes(1, make_pair(width, 1L));
+    long repeat = 1;
+    for(size_t s=0; s<pass.segments.size(); s++)
+    {
+        const PipelineSegment& segment = pass.segments[s];
+        if(segment.geometry == 6)
+        {
+            out_width = out_width * segment.geometry_stage.x_scale;
+            out_height = out_height * segment.geometry_stage.y_scale;
+            shapes.push_back(make_pair(out_width, shapes.back().second));
+            repeat = repeat * segment.geometry_stage.y_scale;
+        }
+        for(size_t k=0; k<segment.ops.size(); k++)
+        {
+            if(segment.ops[k].vignette && repeat > 1)
+            {
+                shapes.push_back(make_pair(out_width, shapes.back().second * repeat));
+                repeat = 1;
+            }
+        }
+    }
+    long row_cost = pass.turns == 0 ? 0 : make_image(width, 0).stride;
+    for(size_t i=0; i<shapes.size(); i++)
+    {
+        row_cost = row_cost + make_image(shapes[i].first, 0).stride * shapes[i].second;
+    }
+    band_rows = (int)max(1L, min((long)height, budget / (row_cost * STREAM_SLOTS)));
+
+    StreamOutput output;
+    if(!open_stream_output(output_name, out_width, out_height, output))
+    {
+        close(input.fd);
+        return false;
+    }
+    vector<PyramidLevel> pyramid;
+    bool success = open_pyramid(pyramid_name, out_width, out_height, levels, pyramid);
+
+    // The buffers are reused by every band, and outlive the I/O queue
+    vector<StreamSlot> slots(STREAM_SLOTS);
+    for(size_t j=0; j<slots.size(); j++)
+    {
+        for(size_t i=0; i<shapes.size(); i++)
+        {
+            slots[j].bands.push_back(make_uninitialized_image(shapes[i].first, band_rows * shapes[i].second));
+        }
+        slots[j].source = make_image(0, 0);
+        slots[j].reading = -1;
+        slots[j].writing = -1;
+    }
+    IoQueue io;
+
+    // Starts reading the band at first_row: the rows themselves, or the
+    // mirrored rows for a 180 degree turn. The columns a quarter turn needs
+    // come from every row, so they are read when the band is filtered.
+    auto start_read = [&](StreamSlot& slot, int first_row)
+    {
+        int rows = min(band_rows, height - first_row);
+        vector<struct iovec> parts;
+        off_t offset;
+        if(pass.turns == 0)
+        {
+            offset = stream_row_parts(input, first_row, rows, slot.bands[0], slot.scanlines, parts);
+        }
+        else if(pass.turns == 2)
+        {
+            if(slot.source.height != rows)
+            {
+                slot.source = make_uninitialized_image(width, rows);
+            }
+            offset = stream_row_parts(input, height - (first_row + rows), rows, slot.source, slot.scanlines, parts);
+        }
+        else
+        {
+            return;
+        }
+        slot.reading = io.submit(false, input.fd, offset, parts);
+    };
+
+    int band_count = (height + band_rows - 1) / band_rows;
+    start_read(slots[0], 0);
+    for(int b=0; b<band_count && success; b++)
+    {
+        StreamSlot& slot = slots[b % STREAM_SLOTS];
+        vector<Image>& bands = slot.bands;
+        int first_row = b * band_rows;
+        int rows = min(band_rows, height - first_row);
+        if(pass.turns == 1 || pass.turns == 3)
+        {
+            if(slot.source.width != rows)
+            {
+                slot.source = make_uninitialized_image(rows, input.header.height);
+            }
+            int first_column = pass.turns == 1 ? first_row : input.header.width - (first_row + rows);
+            success = read_stream_columns(input, first_column, rows, slot.source);
+        }
+        else
+        {
+            success = io.wait(slot.reading);
+            slot.reading = -1;
+            if(success)
+            {
+                finish_stream_rows(input, rows, pass.turns == 0 ? bands[0] : slot.source, slot.scanlines);
+            }
+        }
+        if(success && pass.turns != 0)
+        {
+            parallel_rows(rows, [&](int first, int last)
+            {
+                rotate_rows(slot.source, bands[0], pass.turns, first, last);
+            });
+        }
+
+        // Read ahead into the slot whose band was written two bands ago
+        if(success && b + 1 < band_count)
+        {
+            StreamSlot& next = slots[(b + 1) % STREAM_SLOTS];
+            if(next.writing >= 0)
+            {
+                success = io.wait(next.writing);
+                next.writing = -1;
+            }
+            if(success)
+            {
+                start_read(next, first_row + band_rows);
+            }
+        }
+
+        // Band row i fills image rows top_row + i * repeat onwards
+        int top_row = first_row;
+        int repeat = 1;
+        int image_width = width;
+        int image_height = height;
+        size_t next = 1;
+        Image* band = &bands[0];
+        for(size_t s=0; s<pass.segments.size() && success; s++)
+        {
+            const PipelineSegment& segment = pass.segments[s];
+            if(segment.geometry == 6)
+            {
+                int x_scale = segment.geometry_stage.x_scale;
+                Image& new_band = bands[next++];
+                parallel_rows(rows, [&](int first, int last)
+                {
+                    enlarge_rows(*band, new_band, x_scale, 1, first, last);
+                });
+                band = &new_band;
+                repeat = repeat * segment.geometry_stage.y_scale;
+                top_row = top_row * segment.geometry_stage.y_scale;
+                image_width = image_width * x_scale;
+                image_height = image_height * segment.geometry_stage.y_scale;
+            }
+
+            for(size_t k=0; k<segment.ops.size(); k++)
+            {
+                const PipelineOp& op = segment.ops[k];
+                if(op.vignette && repeat > 1)
+                {
+                    Image& new_band = bands[next++];
+                    parallel_rows(rows * repeat, [&](int first, int last)
+                    {
+                        enlarge_rows(*band, new_band, 1, repeat, first, last);
+                    });
+                    band = &new_band;
+                    rows = rows * repeat;
+                    repeat = 1;
+                }
+                parallel_rows(rows, [&](int first, int last)
+                {
+                    if(op.vignette)
+                    {
+                        apply_vignette_band(image_width, image_height, *band, top_row, first, last);
+                    }
+                    else
+                    {
+                        apply_point_lut(op.lut, *band, *band, first, last);
+                    }
+                });
+            }
+        }
+        if(success)
+        {
+            vector<struct iovec> parts;
+            off_t offset = stream_write_parts(output, top_row, *band, rows, repeat, parts);
+            slot.writing = io.submit(true, output.fd, offset, parts);
+        }
+        if(success && !pyramid.empty())
+        {
+            vector<const unsigned char*> finished;
+            for(int i=0; i<rows; i++)
+            {
+                finished.insert(finished.end(), repeat, image_row(*band, i));
+            }
+            success = add_pyramid_rows(pyramid, 0, finished, out_width, b + 1 == band_count);
+        }
+    }
+
+    // Every read and write ends before the buffers go
+    for(size_t j=0; j<slots.size(); j++)
+    {
+        if(slots[j].reading >= 0)
+        {
+            io.wait(slots[j].reading);
+        }
+        if(slots[j].writing >= 0)
+        {
+            success = io.wait(slots[j].writing) && success;
+        }
+    }
+
+    PROFILE_COUNTS(input.header.file_size, (long)output.stride * output.height + 54,
+                   (long)input.header.width * input.header.height);
+    close(input.fd);
+    success = close(output.fd) == 0 && success;
+    return close_pyramid(pyramid, success);
+}
+
+/**
+ * Applies filter stages to a BMP file of any size in bounded memory
+ * Rows are read, filtered and written in bands, so peak memory depends on
+ * the width and the budget rather than the height. Each rotation needs its
+ * own pass over a file, so a recipe with a rotation after other filters
+ * writes a temporary file next to the output first. The last pass also
+ * writes the pyramid_levels() reduced copies of the output.
+ * @param input_name  Source BMP file
+ * @param output_name Destination BMP file, replaced only on success
+ * @param stages      The recipe
+ * @param budget      Bytes allowed for the bands
+ * @param band_rows   Set to the rows per band of each pass
+ * @return True if successful and false otherwise
+ */
+bool stream_stages(string input_name, string output_name, const vector<FilterStage>& stages, long budget, vector<int>& band_rows)
+{
+    vector<StreamPass> passes = plan_stream(stages);
+    band_rows.assign(passes.size(), 0);
+    string source = input_name;
+    for(size_t p=0; p<passes.size(); p++)
+    {
+        string target = output_name + ".part" + to_string(p + 1);
+        int levels = p + 1 == passes.size() ? pyramid_levels() : 0;
+        bool success = run_stream_pass(source, target, passes[p], budget, output_name, levels, band_rows[p]);
+        if(source != input_name)
+        {
+            unlink(source.c_str());
+        }
+        if(!success)
+        {
+            unlink(target.c_str());
+            cout << "Could not stream " << source << " to " << output_name << endl;
+            return false;
+        }
+        source = target;
+    }
+    if(rename(source.c_str(), output_name.c_str()) != 0)
+    {
+        unlink(source.c_str());
+        cout << "Could not write " << output_name << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Applies a filter recipe to a BMP file of any size in bounded memory
+ * and reports the band height of each pass
+ * @param input_name  Source BMP file
+ * @param output_name Destination BMP file, replaced only on success
+ * @param recipe      Filter recipe, see parse_recipe()
+ * @param megabytes   Memory allowed for the bands
+ * @return True if successful and false otherwise
+ */
+bool run_stream(string input_name, string output_name, string recipe, int megabytes)
+{
+    vector<FilterStage> stages;
+    if(!parse_recipe(recipe, stages))
+    {
+        cout << "Invalid recipe: " << recipe << endl;
+        return false;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<int> band_rows;
+    if(!stream_stages(input_name, output_name, stages, (long)megabytes << 20, band_rows))
+    {
+        return false;
+    }
+    for(size_t p=0; p<band_rows.size(); p++)
+    {
+        cout << "Pass " << p + 1 << " of " << band_rows.size() << ": " << band_rows[p] << " rows per band" << endl;
+    }
+    cout << "Streamed " << input_name << " to " << output_name << " in " << fixed << setprecision(1)
+         << elapsed_ms(start) << " ms" << endl;
+    return true;
+}
+
+// Number of filter results remembered for the current input image
+const int SESSION_RESULTS = 4;
+
+// The decoded input image and its recent filter results, kept across menu
+// operations so that an image is decoded once however many filters run
+struct SessionCache
+{
+    string path;
+    long size;
+    long mtime_ns;
+    shared_ptr<const Image> image;                          // Null until decoded
+    vector<pair<string, shared_ptr<const Image>>> results;  // By recipe, most recent last
+};
+
+// Forgets the input image and every result
+void clear_session(SessionCache& session)
+{
+    session.path.clear();
+    session.size = 0;
+    session.mtime_ns = 0;
+    session.image.reset();
+    session.results.clear();
+}
+
+/**
+ * Makes sure the session describes the file as it is on disk now, clearing
+ * it when the path, size or modification time differ
+ * @param session The session cache
+ * @param filename The current input image
+ * @return False if the file does not exist
+ */
+bool refresh_session(SessionCache& session, string filename)
+{
+    struct stat info;
+    if(stat(filename.c_str(), &info) != 0)
+    {
+        clear_session(session);
+        return false;
+    }
+    long mtime_ns = (long)info.st_mtim.tv_sec * 1000000000L + info.st_mtim.tv_nsec;
+    if(session.path != filename || session.size != (long)info.st_size || session.mtime_ns != mtime_ns)
+    {
+        clear_session(session);
+        session.path = filename;
+        session.size = info.st_size;
+        session.mtime_ns = mtime_ns;
+    }
+    return true;
+}
+
+/**
+ * Gets the result of a recipe on the input image, reusing the decoded image
+ * and any earlier result of the same recipe
+ * A lone grayscale, high contrast or darken on an image that has not been
+ * decoded yet reads straight from the mapped file instead of decoding it
+ * @param session  The session cache
+ * @param filename The current input image
+ * @param stages   The recipe
+ * @return the filtered image, or null if the input is not a valid image
+ */
+shared_ptr<const Image> session_result(SessionCache& session, string filename, const vector<FilterStage>& stages)
+{
+    if(!refresh_session(session, filename))
+    {
+        return nullptr;
+    }
+
+    string key = format_recipe(stages);
+    for(size_t i=0; i<session.results.size(); i++)
+    {
+        if(session.results[i].first == key)
+        {
+            pair<string, shared_ptr<const Image>> hit = session.results[i];
+            session.results.erase(session.results.begin() + i);
+            session.results.push_back(hit);
+            return hit.second;
+        }
+    }
+
+    shared_ptr<const Image> result;
+    int process = stages.size() == 1 ? stages[0].process : 0;
+    MappedImage view;
+    if(!session.image && (process == 3 || process == 7 || process == 9) && map_image(filename, view))
+    {
+        if(process == 3)
+        {
+            result = make_shared<const Image>(process_3(view));
+        }
+        else if(process == 7)
+        {
+            result = make_shared<const Image>(process_7(view));
+        }
+        else
+        {
+            result = make_shared<const Image>(process_9(view, stages[0].scaling_factor));
+        }
+        unmap_image(view);
+    }
+    else
+    {
+        if(!session.image)
+        {
+            Image image = read_packed_image(filename);
+            if(image.width == 0)
+            {
+                return nullptr;
+            }
+            session.image = make_shared<const Image>(move(image));
+        }
+        result = make_shared<const Image>(run_pipeline(*session.image, stages));
+    }
+
+    if((int)session.results.size() >= SESSION_RESULTS)
+    {
+        session.results.erase(session.results.begin());
+    }
+    session.results.push_back(make_pair(key, result));
+    return result;
+}
+
+// Default queued jobs for --serve, and the longest request line accepted
+const int SERVE_QUEUE = 64;
+const size_t SERVE_LINE_BYTES = 16384;
+// Recent job latencies kept for the percentiles, and planned recipes kept
+// by each worker
+const int SERVE_LATENCIES = 4096;
+const int SERVE_PLANS = 32;
+// Largest BMP file a DATA request may send
+const long SERVE_DATA_BYTES = 1L << 30;
+
+// A client of the job server. Workers answer jobs as they finish, so each
+// response is written whole under the lock
+struct ServeConnection
+{
+    int fd;
+    mutex write_mutex;
+
+    explicit ServeConnection(int fd) : fd(fd)
+    {
+    }
+
+    ~ServeConnection()
+    {
+        close(fd);
+    }
+};
+
+// One request waiting for or being processed by a worker
+struct ServeJob
+{
+    shared_ptr<ServeConnection> connection;
+    string id;
+    string recipe;
+    string input;           // Path to read, empty for inline bytes
+    PixelBuffer bytes;      // Inline BMP file
+    string output;          // Path to write, or "-" to send the result back
+    chrono::steady_clock::time_point received;
+};
+
+// The job queue and the counters behind STATS
+struct ServeState
+{
+    BoundedQueue<unique_ptr<ServeJob>> queue;
+    int workers;
+    mutex stats_mutex;
+    int running;
+    long completed;
+    long failed;
+    long rejected;
+    vector<double> latencies;   // Ring of the last SERVE_LATENCIES jobs, in ms
+    size_t next_latency;
+
+    ServeState(int workers, int queue_size) : queue(queue_size), workers(workers), running(0),
+        completed(0), failed(0), rejected(0), next_latency(0)
+    {
+    }
+};
+
+// A socket read through a buffer, so request lines are not read a byte at a time
+struct SocketReader
+{
+    int fd;
+    vector<char> buffer;
+    size_t start;
+    size_t end;
+};
+
+// Refills an empty reader; returns false at the end of the stream
+bool fill_reader(SocketReader& reader)
+{
+    reader.start = 0;
+    reader.end = 0;
+    ssize_t got;
+    do
     {
-        for(int c=0; c<width; c++)
-        {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            
-            double distance = sqrt(pow((c - width/2),2) + pow((r - height/2),2));
-            double scaling_factor = (height - distance) / height;
-            int new_red = red * scaling_factor;
-            int new_green = green * scaling_factor;
-            int new_blue = blue * scaling_factor;
-            
-            new_image[r][c].red = new_red;
-            new_image[r][c].green = new_green;
-            new_image[r][c].blue = new_blue;
-        }
+        got = read(reader.fd, reader.buffer.data(), reader.buffer.size());
+    } while(got < 0 && errno == EINTR);
+    if(got <= 0)
+    {
+        return false;
     }
-    return new_image;
+    reader.end = got;
+    return true;
 }
 
-
-//Adds Clarendon effect to image (darks darker and lights lighter) by a scaling factor
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+/**
+ * Reads one request line
+ * @param reader The connection
+ * @param line   The line, without its newline or a trailing carriage return
+ * @return False at the end of the stream or if the line is too long
+ */
+bool read_line(SocketReader& reader, string& line)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    line.clear();
+    while(true)
     {
-        for(int c=0; c<width; c++)
+        if(reader.start == reader.end && !fill_reader(reader))
         {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            int average = (red + green + blue) / 3;
-            
-            if(average >= 170)
-            {
-                new_image[r][c].red = 255 - (255 - red) * scaling_factor;
-                new_image[r][c].green = 255 - (255 - green) * scaling_factor;
-                new_image[r][c].blue = 255 - (255 - blue) * scaling_factor;
-            }
-            else if(average < 90)
-            {
-                new_image[r][c].red = red * scaling_factor;
-                new_image[r][c].green = green * scaling_factor;
-                new_image[r][c].blue = blue * scaling_factor;
-            }
-            else
+            return false;
+        }
+        const char* first = reader.buffer.data() + reader.start;
+        const char* last = reader.buffer.data() + reader.end;
+        const char* newline = find(first, last, '\n');
+        line.append(first, newline);
+        if(line.size() > SERVE_LINE_BYTES)
+        {
+            return false;
+        }
+        if(newline != last)
+        {
+            reader.start = newline + 1 - reader.buffer.data();
+            if(!line.empty() && line[line.size() - 1] == '\r')
             {
-                new_image[r][c].red = red;
-                new_image[r][c].green = green;
-                new_image[r][c].blue = blue;
+                line.erase(line.size() - 1);
             }
+            return true;
         }
+        reader.start = reader.end;
     }
-    return new_image;
 }
 
-
-// Grayscale image
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+/**
+ * Reads a block of bytes that follows a request line
+ * @param reader The connection
+ * @param dest   Where to put them
+ * @param size   How many to read
+ * @return False if the stream ends first
+ */
+bool read_bytes(SocketReader& reader, unsigned char* dest, size_t size)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    size_t buffered = min(size, reader.end - reader.start);
+    memcpy(dest, reader.buffer.data() + reader.start, buffered);
+    reader.start += buffered;
+    if(buffered == size)
     {
-        for(int c=0; c<width; c++)
-        {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            int gray_value = (red + green + blue) / 3;
-                
-             new_image[r][c].red = gray_value;
-             new_image[r][c].green = gray_value;
-             new_image[r][c].blue = gray_value;
-        }
+        return true;
     }
-    return new_image;
+    vector<struct iovec> parts(1);
+    parts[0].iov_base = dest + buffered;
+    parts[0].iov_len = size - buffered;
+    return read_all(reader.fd, parts);
 }
 
-
-// Rotates image by 90 degrees clockwise (not counter-clockwise)
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+// Sends one response line, whole
+bool send_line(ServeConnection& connection, string line)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(width, vector<Pixel> (height));
-    
-    for(int r=0; r<height; r++)
-    {
-        for(int c=0; c<width; c++)
-        {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            
-            new_image[c][(height-1)-r].red = red;
-            new_image[c][(height-1)-r].green = green;
-            new_image[c][(height-1)-r].blue = blue;
-        }
-    }
-    return new_image;
+    line += "\n";
+    vector<struct iovec> parts(1);
+    parts[0].iov_base = (void*)line.data();
+    parts[0].iov_len = line.size();
+    lock_guard<mutex> lock(connection.write_mutex);
+    return write_all(connection.fd, parts);
 }
-    
 
-// Rotates image by a specified number of multiples of 90 degrees clockwise
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+// Records a finished job for STATS
+void record_job(ServeState& state, bool success, double latency_ms)
 {
-    int angle = number * 90;
-    
-    if(angle%90 != 0)
-    {
-        cout << "angle must be a multiple of 90 degrees.";
-        return image;
-    }
-    else if(angle%360 == 0)
+    lock_guard<mutex> lock(state.stats_mutex);
+    state.running--;
+    if(success)
     {
-        return image;
+        state.completed++;
     }
-    else if(angle%360 == 90)
+    else
     {
-        return process_4(image);
+        state.failed++;
     }
-    else if(angle%360 == 180)
+    if((int)state.latencies.size() < SERVE_LATENCIES)
     {
-        return process_4(process_4(image));
+        state.latencies.push_back(latency_ms);
     }
     else
     {
-        return process_4(process_4(process_4(image)));
+        state.latencies[state.next_latency] = latency_ms;
     }
+    state.next_latency = (state.next_latency + 1) % SERVE_LATENCIES;
 }
 
+/**
+ * Describes the server for the STATS request
+ * @param state The server
+ * @return one line of name=value pairs; latencies are from receipt to
+ *         response over the recent jobs, in milliseconds
+ */
+string format_serve_stats(ServeState& state)
+{
+    size_t queued = state.queue.size();
+    vector<double> latencies;
+    ostringstream stats;
+    {
+        lock_guard<mutex> lock(state.stats_mutex);
+        latencies = state.latencies;
+        stats << "STATS queued=" << queued << " running=" << state.running << " workers=" << state.workers
+              << " completed=" << state.completed << " failed=" << state.failed
+              << " rejected=" << state.rejected;
+    }
+    sort(latencies.begin(), latencies.end());
+    const int PERCENTILES[] = {50, 90, 99};
+    stats << fixed << setprecision(1);
+    for(int i=0; i<3; i++)
+    {
+        size_t index = latencies.empty() ? 0 : (latencies.size() - 1) * PERCENTILES[i] / 100;
+        stats << " p" << PERCENTILES[i] << "_ms=" << (latencies.empty() ? 0 : latencies[index]);
+    }
+    stats << " max_ms=" << (latencies.empty() ? 0 : latencies.back());
+    return stats.str();
+}
 
-// Enlarges the image in the x and y direction
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+/**
+ * Decodes, filters and answers or writes out one job
+ * @param job   The job
+ * @param image The worker's image, reused from job to job
+ * @param plans The worker's planned recipes
+ * @param error Set to the reason the job failed
+ * @return False if the result could not be sent back
+ */
+bool run_serve_job(ServeJob& job, Image& image, map<string, vector<PipelineSegment>>& plans, string& error)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height*y_scale, vector<Pixel> (width*x_scale));
-    
-    for(int r=0; r<height*y_scale; r++)
+    map<string, vector<PipelineSegment>>::iterator plan = plans.find(job.recipe);
+    if(plan == plans.end())
     {
-        for(int c=0; c<width*x_scale; c++)
+        vector<FilterStage> stages;
+        if(parse_recipe(job.recipe, stages))
         {
-            int red = image[r/y_scale][c/x_scale].red;
-            int green = image[r/y_scale][c/x_scale].green;
-            int blue = image[r/y_scale][c/x_scale].blue;
-            
-            new_image[r][c].red = red;
-            new_image[r][c].green = green;
-            new_image[r][c].blue = blue;
+            if((int)plans.size() >= SERVE_PLANS)
+            {
+                plans.clear();
+            }
+            plan = plans.insert(make_pair(job.recipe, plan_pipeline(stages))).first;
+        }
+        else
+        {
+            error = "invalid recipe";
         }
     }
-    return new_image;
-}
 
+    bool decoded = false;
+    if(error.empty())
+    {
+        decoded = job.input.empty() ? decode_packed_image(job.bytes.data(), job.bytes.size(), image)
+                                    : read_packed_image(job.input, image);
+        job.bytes.reset(0);
+        if(!decoded)
+        {
+            error = "not a readable BMP";
+        }
+    }
 
-// Convert image to high contrast (black and white only)
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
-{
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    if(decoded && !pipeline_fits(plan->second, image.width, image.height))
     {
-        for(int c=0; c<width; c++)
+        decoded = false;
+        error = "result too large";
+    }
+
+    bool sent = true;
+    if(decoded)
+    {
+        run_pipeline_in_place(image, plan->second);
+        if(job.output == "-")
         {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            double gray_value = (red + green + blue) / 3;
-            
-            if(gray_value >= 255/2)
+            // The result follows its response line
+            vector<unsigned char> file;
+            bool paletted = palette_output() && encode_paletted_image(image, file);
+            ostringstream line;
+            line << "OK " << job.id << " " << fixed << setprecision(1) << elapsed_ms(job.received)
+                 << " " << image.width << "x" << image.height << " "
+                 << (paletted ? (long)file.size() : 54 + (long)image.stride * image.height) << "\n";
+            lock_guard<mutex> lock(job.connection->write_mutex);
+            if(paletted)
             {
-                new_image[r][c].red = 255;
-                new_image[r][c].green = 255;
-                new_image[r][c].blue = 255;
+                string text = line.str();
+                vector<struct iovec> parts(2);
+                parts[0].iov_base = (void*)text.data();
+                parts[0].iov_len = text.size();
+                parts[1].iov_base = file.data();
+                parts[1].iov_len = file.size();
+                sent = write_all(job.connection->fd, parts);
             }
             else
             {
-                new_image[r][c].red = 0;
-                new_image[r][c].green = 0;
-                new_image[r][c].blue = 0;
+                sent = write_packed_image(job.connection->fd, image, line.str());
             }
         }
+        else if(!write_result_image(job.output, image))
+        {
+            error = "could not write " + job.output;
+        }
     }
-    return new_image;
+    return sent;
 }
 
-    
-// Lightens image by a scaling factor
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)     
+/**
+ * Takes jobs off the queue until it is closed
+ * Each worker keeps the image it decodes into and filters it in place, so
+ * once the buffer fits the usual frame size no point filter job allocates
+ * pixels. It also keeps the tables of the recipes it has planned. Vignette
+ * maps are cached by vignette_map().
+ * @param state The server
+ * @return nothing
+ */
+void serve_worker(ServeState& state)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    Image image;
+    map<string, vector<PipelineSegment>> plans;
+    unique_ptr<ServeJob> job;
+    while(state.queue.pop(job))
     {
-        for(int c=0; c<width; c++)
         {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            
-            new_image[r][c].red = 255 - (255 - red)*scaling_factor;
-            new_image[r][c].green = 255 - (255 - green)*scaling_factor;
-            new_image[r][c].blue = 255 - (255 - blue)*scaling_factor;
+            lock_guard<mutex> lock(state.stats_mutex);
+            state.running++;
         }
-    }
-    return new_image;
-}
-    
-    
-// Darkens image by a scaling factor
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)    
-{
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
-    {
-        for(int c=0; c<width; c++)
+        PROFILE_SCOPE("job");
+        string error;
+        bool sent = true;
+        try
         {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            
-            new_image[r][c].red = red * scaling_factor;
-            new_image[r][c].green = green * scaling_factor;
-            new_image[r][c].blue = blue * scaling_factor;
+            sent = run_serve_job(*job, image, plans, error);
+        }
+        catch(const bad_alloc&)
+        {
+            // Give the memory back before the next job
+            image = Image();
+            job->bytes.reset(0);
+            error = "out of memory";
+        }
+
+        // Counted before the answer goes out, so a STATS sent after it sees the job
+        double latency = elapsed_ms(job->received);
+        record_job(state, error.empty() && sent, latency);
+        if(error.empty() && job->output != "-")
+        {
+            ostringstream line;
+            line << "OK " << job->id << " " << fixed << setprecision(1) << latency
+                 << " " << image.width << "x" << image.height;
+            send_line(*job->connection, line.str());
+        }
+        else if(!error.empty())
+        {
+            send_line(*job->connection, "ERR " + job->id + " " + error);
         }
+        job.reset();
     }
-    return new_image;
 }
-    
-    
-// Converts image to only black, white, red, blue, and green
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+
+/**
+ * Reads the requests of one client and queues its jobs
+ * Requests are lines:
+ *   JOB ID RECIPE OUTPUT INPUT   filters the BMP file INPUT (the rest of the line)
+ *   DATA ID RECIPE OUTPUT SIZE   filters the SIZE bytes of BMP file that follow
+ *   STATS                        reports the queue depth and job latencies
+ * OUTPUT is a path, or "-" to have the result sent back. Each job is
+ * answered when it finishes, so answers may come in any order:
+ *   OK ID MS WIDTHxHEIGHT [SIZE]   followed by SIZE bytes of BMP for "-"
+ *   ERR ID MESSAGE
+ * A job that finds the queue full is answered "ERR ID queue full" at once.
+ * DATA files over SERVE_DATA_BYTES end the connection with "ERR ID bad
+ * DATA size", and recipes whose images would not fit a BMP file are
+ * answered "ERR ID result too large".
+ * @param state      The server
+ * @param connection The client
+ * @return nothing
+ */
+void serve_connection(ServeState& state, shared_ptr<ServeConnection> connection)
 {
-    int height = image.size();
-    int width = image[0].size();
-    vector<vector<Pixel>> new_image(height, vector<Pixel> (width));
-    
-    for(int r=0; r<height; r++)
+    SocketReader reader;
+    reader.fd = connection->fd;
+    reader.buffer.resize(65536);
+    reader.start = 0;
+    reader.end = 0;
+
+    string line;
+    while(read_line(reader, line))
     {
-        for(int c=0; c<width; c++)
+        istringstream fields(line);
+        string command;
+        fields >> command;
+        if(command == "STATS")
         {
-            int red = image[r][c].red;
-            int green = image[r][c].green;
-            int blue = image[r][c].blue;
-            int max_color;
-            
-            if(red >= green && red >= blue)
+            send_line(*connection, format_serve_stats(state));
+            continue;
+        }
+        if(command != "JOB" && command != "DATA")
+        {
+            if(!command.empty())
             {
-                max_color = red;
+                send_line(*connection, "ERR - unknown request " + command);
             }
-            else if(green >= blue)
+            continue;
+        }
+
+        unique_ptr<ServeJob> job(new ServeJob());
+        job->received = chrono::steady_clock::now();
+        job->connection = connection;
+        fields >> job->id >> job->recipe >> job->output;
+        bool valid = !job->output.empty();
+        if(command == "JOB")
+        {
+            getline(fields >> ws, job->input);
+            valid = valid && !job->input.empty();
+        }
+        else
+        {
+            long size = -1;
+            fields >> size;
+            if(size < 54 || size > SERVE_DATA_BYTES)
             {
-                max_color = green;
+                // Without a size the rest of the stream cannot be read
+                send_line(*connection, "ERR " + (job->id.empty() ? "-" : job->id) + " bad DATA size");
+                return;
             }
-            else
+            try
             {
-                max_color = blue;
+                job->bytes.reset(size);
             }
-            
-            if(red + green + blue >= 550)
+            catch(const bad_alloc&)
             {
-                new_image[r][c].red = 255;
-                new_image[r][c].green = 255;
-                new_image[r][c].blue = 255;
+                send_line(*connection, "ERR " + job->id + " out of memory");
+                return;
             }
-            else if(red + green + blue <= 150)
+            if(!read_bytes(reader, job->bytes.data(), size))
             {
-                new_image[r][c].red = 0;
-                new_image[r][c].green = 0;
-                new_image[r][c].blue = 0;
-            }   
-            else if(max_color == red)
+                return;
+            }
+        }
+        if(!valid)
+        {
+            send_line(*connection, "ERR " + (job->id.empty() ? "-" : job->id) + " expected "
+                      + command + " ID RECIPE OUTPUT " + (command == "JOB" ? "INPUT" : "SIZE"));
+            continue;
+        }
+
+        string id = job->id;
+        if(!state.queue.try_push(job))
+        {
             {
-                new_image[r][c].red = 255;
-                new_image[r][c].green = 0;
-                new_image[r][c].blue = 0;
+                lock_guard<mutex> lock(state.stats_mutex);
+                state.rejected++;
             }
-            else if(max_color == green)
+            send_line(*connection, "ERR " + id + " queue full");
+        }
+    }
+}
+
+/**
+ * Serves filter jobs on a Unix socket until the process is killed
+ * Decoding, filtering and encoding of a job all run on one worker. The
+ * filters of jobs on several workers share the scheduler's threads.
+ * @param socket_path Path of the socket, replaced if it exists
+ * @param workers     Worker threads
+ * @param queue_size  Jobs allowed to wait for a worker
+ * @return False if the socket could not be opened
+ */
+bool run_server(string socket_path, int workers, int queue_size)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path))
+    {
+        cout << "Socket path too long: " << socket_path << endl;
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if(listener < 0 || ::bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, SOMAXCONN) != 0)
+    {
+        cout << "Could not listen on " << socket_path << ": " << strerror(errno) << endl;
+        if(listener >= 0)
+        {
+            close(listener);
+        }
+        return false;
+    }
+    // A client that hangs up should fail its writes, not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Detached threads use the state until the process exits, so it is never freed
+    ServeState& state = *new ServeState(workers, queue_size);
+    for(int i=0; i<workers; i++)
+    {
+        thread(serve_worker, ref(state)).detach();
+    }
+    cout << "Serving on " << socket_path << " with " << workers << " workers" << endl;
+
+    while(true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
             {
-                new_image[r][c].red = 0;
-                new_image[r][c].green = 255;
-                new_image[r][c].blue = 0;
+                continue;
             }
-            else
+            if(errno == EMFILE || errno == ENFILE)
             {
-                new_image[r][c].red = 0;
-                new_image[r][c].green = 0;
-                new_image[r][c].blue = 255;
+                // Out of descriptors until a client hangs up
+                this_thread::sleep_for(chrono::milliseconds(10));
+                continue;
             }
+            cout << "accept failed: " << strerror(errno) << endl;
+            close(listener);
+            return false;
         }
+        shared_ptr<ServeConnection> connection = make_shared<ServeConnection>(fd);
+        thread(serve_connection, ref(state), connection).detach();
     }
-    return new_image;
 }
 
 //////////
@@ -560,13 +6862,139 @@ vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
 //////////
     
 
-int main()
+// shepherd_bench.cpp includes this file with IMAGE_PROCESSOR_NO_MAIN defined
+#ifndef IMAGE_PROCESSOR_NO_MAIN
+int main(int argc, char* argv[])
 {
+    // Options: --threads N sets the filter threads.
+    // --scaling-report FILE times the filters at 1 to N threads and exits.
+    // --batch INPUTS --recipe RECIPE --out DIR [--in-flight N] runs a recipe
+    // over many files and exits; INPUTS is a glob pattern or @MANIFEST.
+    // --stream INPUT OUTPUT --recipe RECIPE [--stream-mb N] runs a recipe in
+    // bands of rows using about N MB, for images too large to load, and exits.
+    // --serve SOCKET [--workers N] [--queue N] serves jobs on a Unix socket,
+    // see serve_connection() for the protocol.
+    // --palette writes results with at most 256 colors as paletted BMPs,
+    // RLE compressed when that is smaller.
+    // --pyramid also writes 1/2, 1/4 and 1/8 size copies of each result,
+    // out_1-2.bmp and so on, from the same rows.
+    string scaling_file;
+    string batch_inputs;
+    string batch_recipe;
+    string batch_output;
+    int in_flight = 2;
+    string stream_input;
+    string stream_output;
+    int stream_megabytes = STREAM_MEGABYTES;
+    string serve_socket;
+    int serve_workers = 0;
+    int serve_queue = SERVE_QUEUE;
+    for(int i=1; i<argc; i++)
+    {
+        string option = argv[i];
+        bool has_value = i+1 < argc;
+        if(option == "--threads" && has_value)
+        {
+            set_thread_count(atoi(argv[++i]));
+        }
+        else if(option == "--scaling-report" && has_value)
+        {
+            scaling_file = argv[++i];
+        }
+        else if(option == "--batch" && has_value)
+        {
+            batch_inputs = argv[++i];
+        }
+        else if(option == "--recipe" && has_value)
+        {
+            batch_recipe = argv[++i];
+        }
+        else if(option == "--out" && has_value)
+        {
+            batch_output = argv[++i];
+        }
+        else if(option == "--in-flight" && has_value)
+        {
+            in_flight = max(1, atoi(argv[++i]));
+        }
+        else if(option == "--stream" && i+2 < argc)
+        {
+            stream_input = argv[++i];
+            stream_output = argv[++i];
+        }
+        else if(option == "--stream-mb" && has_value)
+        {
+            stream_megabytes = max(1, atoi(argv[++i]));
+        }
+        else if(option == "--serve" && has_value)
+        {
+            serve_socket = argv[++i];
+        }
+        else if(option == "--workers" && has_value)
+        {
+            serve_workers = max(1, atoi(argv[++i]));
+        }
+        else if(option == "--queue" && has_value)
+        {
+            serve_queue = max(1, atoi(argv[++i]));
+        }
+        else if(option == "--palette")
+        {
+            palette_output() = true;
+        }
+        else if(option == "--pyramid")
+        {
+            pyramid_levels() = PYRAMID_LEVELS;
+        }
+        else
+        {
+            cout << "Unknown option: " << option << endl;
+            cout << "Usage: " << argv[0] << " [--threads N] [--palette] [--pyramid] [--scaling-report FILE]" << endl;
+            cout << "       " << argv[0] << " [--threads N] --batch 'GLOB'|@MANIFEST --recipe RECIPE --out DIR [--in-flight N]" << endl;
+            cout << "       " << argv[0] << " [--threads N] --stream INPUT OUTPUT --recipe RECIPE [--stream-mb N]" << endl;
+            cout << "       " << argv[0] << " [--threads N] --serve SOCKET [--workers N] [--queue N]" << endl;
+            cout << "  --palette writes results with at most 256 colors as 1, 4 or 8 bit BMPs" << endl;
+            cout << "  --pyramid also writes 1/2, 1/4 and 1/8 size copies of each result" << endl;
+            return 1;
+        }
+    }
+    if(!scaling_file.empty())
+    {
+        return print_scaling_report(scaling_file) ? 0 : 1;
+    }
+    if(!serve_socket.empty())
+    {
+        // One worker per filter thread unless told otherwise
+        return run_server(serve_socket, serve_workers > 0 ? serve_workers : configured_threads(), serve_queue) ? 0 : 1;
+    }
+    if(!stream_input.empty())
+    {
+        if(batch_recipe.empty())
+        {
+            cout << "--stream needs --recipe" << endl;
+            return 1;
+        }
+        return run_stream(stream_input, stream_output, batch_recipe, stream_megabytes) ? 0 : 1;
+    }
+    if(!batch_inputs.empty())
+    {
+        if(batch_recipe.empty() || batch_output.empty())
+        {
+            cout << "--batch needs --recipe and --out" << endl;
+            return 1;
+        }
+        return run_batch(batch_inputs, batch_recipe, batch_output, in_flight) ? 0 : 1;
+    }
+
     cout << "Image Processing Application" << endl;
     cout << "Enter input BPM filename: " << endl;
     string input_filename;
     cin >> input_filename;
     
+    // Decoded input and recent results, reused until the image changes
+    SessionCache session;
+    clear_session(session);
+    
     string menu_input = "N";
     
     while(menu_input != "Q")
@@ -583,6 +7011,7 @@ int main()
         cout << "8) Lighten" << endl;
         cout << "9) Darken" << endl;
         cout << "10) Black, white, red, green, and blue only " << endl;
+        cout << "11) Filter recipe (several processes in one pass)" << endl;
         
         cin >> menu_input;
         
@@ -597,6 +7026,7 @@ int main()
             cout << "Change Image Selected" << endl;
             cout << "Please enter new BMP filename:" << endl;
             cin >> input_filename;
+            clear_session(session);
             cout << "Successfully changed input image" << endl;
         }
 //             process 1 
@@ -607,9 +7037,9 @@ int main()
             string output_filename;
             cin >> output_filename;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_1(image);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(1));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -632,9 +7062,9 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_2(image, scaling_factor);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(2, scaling_factor));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -653,9 +7083,9 @@ int main()
             string output_filename;
             cin >> output_filename;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_3(image);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(3));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -674,9 +7104,9 @@ int main()
             string output_filename;
             cin >> output_filename;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_4(image);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(4));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -699,9 +7129,9 @@ int main()
             int num_rotations;
             cin >> num_rotations;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_5(image, num_rotations);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(5, 1.0, num_rotations));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -727,9 +7157,9 @@ int main()
             int y_scale;
             cin >> y_scale;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_6(image, x_scale, y_scale);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(6, 1.0, 0, x_scale, y_scale));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -748,9 +7178,9 @@ int main()
             string output_filename;
             cin >> output_filename;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_7(image);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(7));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -773,9 +7203,9 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_8(image, scaling_factor);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(8, scaling_factor));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -798,9 +7228,9 @@ int main()
             double scaling_factor;
             cin >> scaling_factor;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_9(image, scaling_factor);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(9, scaling_factor));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -819,9 +7249,9 @@ int main()
             string output_filename;
             cin >> output_filename;
             
-            vector<vector<Pixel>> image = read_image(input_filename);
-            vector<vector<Pixel>> new_image = process_10(image);
-            bool success = write_image(output_filename, new_image);
+            vector<FilterStage> stages(1, make_stage(10));
+            shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+            bool success = new_image && write_result_image(output_filename, *new_image);
             
             if(success)
             {
@@ -832,12 +7262,43 @@ int main()
                 cout << "An error has occurred. Please try again" << endl;
             }
         }
+//             filter recipe
+        else if(menu_input == "11")
+        {
+            cout << "Filter recipe selected" << endl;
+            cout << "Enter output filename: " << endl;
+            string output_filename;
+            cin >> output_filename;
+            
+            cout << "Enter recipe, process numbers separated by commas (e.g. 9:0.5,2:0.3,1,6:2x2): " << endl;
+            string recipe;
+            cin >> recipe;
+            
+            vector<FilterStage> stages;
+            bool success = parse_recipe(recipe, stages);
+            if(success)
+            {
+                shared_ptr<const Image> new_image = session_result(session, input_filename, stages);
+                success = new_image && write_result_image(output_filename, *new_image);
+            }
+            
+            if(success)
+            {
+                cout << "Successfully applied recipe" << endl;
+            }
+            else
+            {
+                cout << "An error has occurred. Please try again" << endl;
+            }
+        }
 //             invalid input message
         else
         {
             cout << "Please enter a valid menu number or Q to quit" << endl;
         }
+        PROFILE_RUN_END();
     }
     
     return 0;
-}
\ No newline at end of file
+}
+#endif